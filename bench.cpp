@@ -0,0 +1,372 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Benchmark
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <algorithm>
+
+#include "xbit.h"
+#include "transport.h"
+
+#define BENCH_SEED			0x5842
+#define KERNEL_IMAGE_SIZE	(2 * 1024 * 1024)
+#define KERNEL_CHECK_SIZES	300		// Every length up to this gets checked against the scalar kernels
+#define KERNEL_ROUNDS		50		// Passes over the image per measurement
+
+typedef struct
+{
+	FILE *out;
+	int results;		// JSON objects written so far, for the separators
+} BENCH;
+
+uint32 Percentile(std::vector<uint32> &samples, int percent)
+{
+	if(samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	return samples[(samples.size() - 1) * percent / 100];
+}
+
+void WriteLatency(FILE *out, const char *name, std::vector<uint32> &samples)
+{
+	fprintf(out, "\"%s\": {\"count\": %zu, \"p50_us\": %u, \"p95_us\": %u, \"p99_us\": %u}",
+		name, samples.size(), Percentile(samples, 50), Percentile(samples, 95), Percentile(samples, 99));
+}
+
+void StartOp(XbitFlasher *flasher, IO_STATS *stats)
+{
+	stats->write_us.clear();
+	stats->read_us.clear();
+	stats->write_bytes = 0;
+	stats->read_bytes = 0;
+	flasher->io_stats = stats;
+}
+
+// bytes is the payload the operation moved, 0 where that does not apply (format/erase)
+void EndOp(BENCH *bench, XbitFlasher *flasher, IO_STATS *stats, const char *op, int layout, int bank,
+	int bytes, bool ok, unsigned long long elapsed_us)
+{
+	double seconds = elapsed_us / 1000000.0;
+	size_t reports = stats->write_us.size() + stats->read_us.size();
+
+	flasher->io_stats = NULL;
+	fprintf(stderr, "layout %i bank %i %-6s q%-2i %s %8.3f s %10.1f KB/s %8.1f reports/s\n",
+		layout, bank, op, flasher->queue_depth, ok ? "ok  " : "FAIL", seconds,
+		seconds > 0 ? bytes / seconds / 1024 : 0, seconds > 0 ? reports / seconds : 0);
+
+	fprintf(bench->out, "%s\n    {\"layout\": %i, \"bank\": %i, \"op\": \"%s\", \"queue_depth\": %i, \"ok\": %s, ",
+		bench->results++ ? "," : "", layout, bank, op, flasher->queue_depth, ok ? "true" : "false");
+	fprintf(bench->out, "\"seconds\": %.6f, \"bytes\": %i, \"bytes_per_s\": %.1f, \"reports\": %zu, \"reports_per_s\": %.1f, ",
+		seconds, bytes, seconds > 0 ? bytes / seconds : 0, reports, seconds > 0 ? reports / seconds : 0);
+	WriteLatency(bench->out, "write", stats->write_us);
+	fprintf(bench->out, ", ");
+	WriteLatency(bench->out, "read", stats->read_us);
+	fprintf(bench->out, "}");
+}
+
+bool CopySector(void *context, int offset, const uchar *data, int length)
+{
+	memcpy((uchar *)context + offset, data, length);
+	return true;
+}
+
+// Format, then erase/write/read/verify every bank of the layout
+bool BenchLayout(BENCH *bench, XbitFlasher *flasher, int layout, uchar *image, uchar *readback)
+{
+	IO_STATS stats;
+	unsigned long long start;
+	int size, bytes_read;
+	bool ok, all_ok = true;
+
+	StartOp(flasher, &stats);
+	start = get_time_us();
+	ok = flasher->Format(layout);
+	EndOp(bench, flasher, &stats, "format", layout, 0, 0, ok, get_time_us() - start);
+	if(!ok)
+		return false;
+
+	for(int bank = 1; bank <= BANKS_MAX; bank++){
+		if(!GetBankSchedule(layout, bank))
+			break;
+		size = GetBankSchedule(layout, bank)->size;
+
+		StartOp(flasher, &stats);
+		start = get_time_us();
+		ok = flasher->EraseBank(bank);
+		EndOp(bench, flasher, &stats, "erase", layout, bank, 0, ok, get_time_us() - start);
+		all_ok &= ok;
+
+		StartOp(flasher, &stats);
+		start = get_time_us();
+		ok = flasher->FlashBank(bank, image, size);
+		EndOp(bench, flasher, &stats, "flash", layout, bank, size, ok, get_time_us() - start);
+		all_ok &= ok;
+
+		StartOp(flasher, &stats);
+		start = get_time_us();
+		bytes_read = 0;
+		ok = flasher->ReadBank(bank, CopySector, readback, &bytes_read) && !memcmp(readback, image, size);
+		EndOp(bench, flasher, &stats, "read", layout, bank, bytes_read, ok, get_time_us() - start);
+		all_ok &= ok;
+
+		StartOp(flasher, &stats);
+		start = get_time_us();
+		ok = flasher->VerifyBank(bank, image, size);
+		EndOp(bench, flasher, &stats, "verify", layout, bank, size, ok, get_time_us() - start);
+		all_ok &= ok;
+	}
+	return all_ok;
+}
+
+// Flash and verify the largest bank of the layout at every queue depth, 1 is the paced report by report path
+bool BenchQueueDepths(BENCH *bench, XbitFlasher *flasher, int layout, uchar *image)
+{
+	IO_STATS stats;
+	unsigned long long start;
+	int bank = 1, size;
+	bool ok, all_ok = true;
+
+	StartOp(flasher, &stats);
+	start = get_time_us();
+	ok = flasher->Format(layout);
+	EndOp(bench, flasher, &stats, "format", layout, 0, 0, ok, get_time_us() - start);
+	if(!ok)
+		return false;
+	for(int i = 2; GetBankSchedule(layout, i); i++){
+		if(GetBankSchedule(layout, i)->size > GetBankSchedule(layout, bank)->size)
+			bank = i;
+	}
+	size = GetBankSchedule(layout, bank)->size;
+
+	for(int depth = 1; depth <= QUEUE_DEPTH_MAX; depth *= 2){
+		flasher->queue_depth = depth;
+		ok = flasher->EraseBank(bank);
+
+		StartOp(flasher, &stats);
+		start = get_time_us();
+		ok = ok && flasher->FlashBank(bank, image, size);
+		EndOp(bench, flasher, &stats, "flash", layout, bank, size, ok, get_time_us() - start);
+		all_ok &= ok;
+
+		StartOp(flasher, &stats);
+		start = get_time_us();
+		ok = flasher->VerifyBank(bank, image, size);
+		EndOp(bench, flasher, &stats, "verify", layout, bank, size, ok, get_time_us() - start);
+		all_ok &= ok;
+	}
+	return all_ok;
+}
+
+// Every kernel set has to give the same answers as the scalar one, for every length and alignment
+bool CheckKernels(const BYTE_KERNELS *kernels, const BYTE_KERNELS *ref, uchar *a, uchar *b)
+{
+	int length, pos;
+
+	for(int align = 0; align < 32; align++){
+		for(length = 0; length <= KERNEL_CHECK_SIZES; length++){
+			memset(a + align, 0xFF, length);
+			memcpy(b + align, a + align, length);
+			if(kernels->is_blank(a + align, length) != ref->is_blank(a + align, length)
+				|| kernels->find_diff(a + align, b + align, length) != -1)
+				return false;
+			for(pos = 0; pos < length; pos++){
+				// One byte off at every position, for the blank test and the compare
+				a[align + pos] = rand() % 0xFF;
+				if(kernels->is_blank(a + align, length) != ref->is_blank(a + align, length)
+					|| kernels->find_diff(a + align, b + align, length) != pos
+					|| kernels->sum8(a + align, length) != ref->sum8(a + align, length))
+					return false;
+				a[align + pos] = 0xFF;
+			}
+		}
+	}
+
+	// Full images with a few scattered differences, walked the way VerifyBank does
+	for(int i = 0; i < KERNEL_IMAGE_SIZE; i++)
+		a[i] = rand();
+	memcpy(b, a, KERNEL_IMAGE_SIZE);
+	for(int i = 0; i < 64; i++)
+		b[rand() % KERNEL_IMAGE_SIZE] ^= 1 + rand() % 0xFF;
+	for(int start = 0, next, ref_next; start < KERNEL_IMAGE_SIZE; start += next + 1){
+		next = kernels->find_diff(a + start, b + start, KERNEL_IMAGE_SIZE - start);
+		ref_next = ref->find_diff(a + start, b + start, KERNEL_IMAGE_SIZE - start);
+		if(next != ref_next)
+			return false;
+		if(next < 0)
+			break;
+	}
+	return kernels->sum8(a, KERNEL_IMAGE_SIZE) == ref->sum8(a, KERNEL_IMAGE_SIZE)
+		&& kernels->is_blank(a, KERNEL_IMAGE_SIZE) == ref->is_blank(a, KERNEL_IMAGE_SIZE);
+}
+
+// MB/s of one kernel over the whole image, sum is only there so the work can't be optimized away
+double KernelSpeed(const BYTE_KERNELS *kernels, int op, const uchar *a, const uchar *b, int *sum)
+{
+	unsigned long long start = get_time_us(), elapsed;
+
+	for(int round = 0; round < KERNEL_ROUNDS; round++){
+		if(op == 0)
+			*sum += kernels->sum8(a, KERNEL_IMAGE_SIZE);
+		else if(op == 1)
+			*sum += kernels->is_blank(a, KERNEL_IMAGE_SIZE);
+		else
+			*sum += kernels->find_diff(a, b, KERNEL_IMAGE_SIZE);
+	}
+	elapsed = get_time_us() - start;
+	return elapsed ? (double)KERNEL_IMAGE_SIZE * KERNEL_ROUNDS / elapsed : 0;
+}
+
+// Self check and micro-benchmark of the byte kernels, no chip involved
+int BenchKernels(FILE *out)
+{
+	static const char *ops[] = {"sum8", "is_blank", "find_diff"};
+	const BYTE_KERNELS *list[BYTE_KERNELS_MAX];
+	int count = byte_kernels_available(list, BYTE_KERNELS_MAX);
+	uchar *a = (uchar *)malloc(KERNEL_IMAGE_SIZE + 64);
+	uchar *b = (uchar *)malloc(KERNEL_IMAGE_SIZE + 64);
+	bool ok, all_ok = true;
+	int sum = 0;
+	double speed;
+
+	fprintf(out, "{\n  \"selected\": \"%s\",\n  \"kernels\": [", byte_kernels()->name);
+	for(int i = 0; i < count; i++){
+		srand(BENCH_SEED);
+		ok = CheckKernels(list[i], list[0], a, b);
+		all_ok &= ok;
+		fprintf(stderr, "%-8s %s", list[i]->name, ok ? "matches scalar" : "DIFFERS FROM SCALAR");
+		fprintf(out, "%s\n    {\"name\": \"%s\", \"equivalent\": %s", i ? "," : "", list[i]->name, ok ? "true" : "false");
+
+		// Blank image for is_blank, equal images for find_diff: both have to scan everything
+		memset(a, 0xFF, KERNEL_IMAGE_SIZE);
+		memset(b, 0xFF, KERNEL_IMAGE_SIZE);
+		for(int op = 0; op < 3; op++){
+			speed = KernelSpeed(list[i], op, a, b, &sum);
+			fprintf(stderr, " %s %8.0f MB/s", ops[op], speed);
+			fprintf(out, ", \"%s_mb_per_s\": %.0f", ops[op], speed);
+		}
+		fprintf(stderr, "\n");
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n  ],\n  \"checksum\": %i\n}\n", sum);
+	free(a);
+	free(b);
+	return all_ok ? 0 : 6;
+}
+
+void PrintUsage(const char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("Runs format/erase/flash/read/verify for every bank layout and writes the results as JSON\n");
+	printf("Options:\n");
+	printf("  --layout=N        Only benchmark layout N (1-%i)\n", BANK_LAYOUT_COUNT);
+	printf("  --output=FILE     Write the JSON to FILE instead of stdout\n");
+	printf("  --transport=NAME  hid, libusb or mem (default: mem, the in-process emulator)\n");
+	printf("  --log             Keep the flasher log on stderr\n");
+	printf("  --kernels         Check the SIMD byte kernels against the scalar ones and time them instead\n");
+	printf("  --queue-depth=N   Keep up to N data reports of a write in flight (default: 1)\n");
+	printf("  --no-pipeline     Prepare each write between the USB calls instead of in a second thread\n");
+	printf("  --queue-sweep     Flash/verify the largest bank of the layout at queue depths 1-%i instead\n", QUEUE_DEPTH_MAX);
+}
+
+int main(int argc, char* argv[])
+{
+	int layout = 0, transport = TRANSPORT_MEMORY, res = 0;
+	const char *output = NULL;
+	int queue_depth = 1;
+	bool keep_log = false, kernels = false, queue_sweep = false, pipeline = true;
+	uchar *image, *readback;
+	BENCH bench;
+	XbitFlasher flasher;
+
+	for(int i = 1; i < argc; i++){
+		if(!strncmp(argv[i], "--layout=", 9))
+			layout = atoi(argv[i] + 9);
+		else if(!strncmp(argv[i], "--output=", 9))
+			output = argv[i] + 9;
+		else if(!strncmp(argv[i], "--transport=", 12))
+			transport = Transport::ParseType(argv[i] + 12);
+		else if(!strcmp(argv[i], "--log"))
+			keep_log = true;
+		else if(!strcmp(argv[i], "--kernels"))
+			kernels = true;
+		else if(!strncmp(argv[i], "--queue-depth=", 14))
+			queue_depth = atoi(argv[i] + 14);
+		else if(!strcmp(argv[i], "--queue-sweep"))
+			queue_sweep = true;
+		else if(!strcmp(argv[i], "--no-pipeline"))
+			pipeline = false;
+		else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+	if(layout < 0 || layout > BANK_LAYOUT_COUNT){
+		printf("Invalid layout parameter supplied. Valid: %i-%i\n", 1, BANK_LAYOUT_COUNT);
+		return 2;
+	}
+	if(queue_depth < 1 || queue_depth > QUEUE_DEPTH_MAX){
+		printf("Invalid queue depth. Valid: 1-%i\n", QUEUE_DEPTH_MAX);
+		return 2;
+	}
+	if(!flasher.SetTransport(transport)){
+		printf("Transport is not available\n");
+		return 1;
+	}
+	if((queue_depth > 1 || queue_sweep) && !flasher.GetTransport()->CanQueue()){
+		printf("Queue depths need a transport that queues reports (libusb, mem)\n");
+		return 2;
+	}
+
+	bench.out = output ? fopen(output, "w") : stdout;
+	if(!bench.out){
+		printf("Failed to open %s\n", output);
+		return 1;
+	}
+	bench.results = 0;
+	if(kernels){
+		res = BenchKernels(bench.out);
+		if(bench.out != stdout)
+			fclose(bench.out);
+		return res;
+	}
+
+	// Random data without 0xFF runs, so every report of a bank gets written
+	image = (uchar *)malloc(2 * 1024 * 1024);
+	readback = (uchar *)malloc(2 * 1024 * 1024);
+	srand(BENCH_SEED);
+	for(int i = 0; i < 2 * 1024 * 1024; i++)
+		image[i] = rand() % 0xFF;
+
+	log_set_output(keep_log ? stderr : NULL);
+	flasher.progress.enabled = false;
+	flasher.cache.enabled = false;
+	flasher.use_profile = false;
+	flasher.queue_depth = queue_depth;
+	flasher.use_pipeline = pipeline;
+	if(!flasher.OpenDevice(NULL)){
+		fprintf(stderr, "Failed to open X-Bit via %s transport\n", flasher.GetTransport()->GetName());
+		res = 3;
+		goto exit_e0;
+	}
+
+	fprintf(bench.out, "{\n  \"transport\": \"%s\",\n  \"results\": [", flasher.GetTransport()->GetName());
+	if(queue_sweep && !BenchQueueDepths(&bench, &flasher, layout ? layout : 1, image))
+		res = 6;
+	for(int i = 1; i <= BANK_LAYOUT_COUNT && !queue_sweep; i++){
+		if(layout && layout != i)
+			continue;
+		if(!BenchLayout(&bench, &flasher, i, image, readback))
+			res = 6;
+	}
+	fprintf(bench.out, "\n  ]\n}\n");
+	flasher.CloseDevice();
+
+exit_e0:
+	if(bench.out != stdout)
+		fclose(bench.out);
+	free(image);
+	free(readback);
+	return res;
+}
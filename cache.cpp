@@ -0,0 +1,245 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Block digest cache
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <direct.h>
+#endif
+
+#include "xbit.h"
+
+typedef struct
+{
+	char magic[4];
+	uint32 version;
+	uint32 layout;
+} CACHE_HEADER;
+
+BlockCache::BlockCache()
+{
+	uchar blank[MAX_SECTOR_SIZE];
+	SHA256_CTX ctx;
+
+	this->enabled = true;
+	this->strict = false;
+	this->loaded = false;
+	this->dirty = false;
+	this->filename[0] = 0;
+	this->layout = 0;
+	memset(this->blocks, 0, sizeof(this->blocks));
+
+	memset(blank, 0xFF, sizeof(blank));
+	sha256_init(&ctx);
+	for(int i = 0; i < SECTORS_PER_BLOCK; i++)
+		sha256_update(&ctx, blank, MAX_SECTOR_SIZE);
+	sha256_final(&ctx, this->blank_digest);
+}
+
+// Spread over the block, so neighbouring blocks with the same header still get told apart
+int BlockCache::SampleOffset(int block)
+{
+	return ((block * 2654435761u) >> 16) % (BLOCK_SIZE / CACHE_SAMPLE) * CACHE_SAMPLE;
+}
+
+// One file per transport and device path and kind of state
+bool state_path(const char *transport, const char *path, const char *ext, char *filename, int size)
+{
+	const char *dir;
+	char key[MAX_STR];
+	int len;
+
+	len = snprintf(key, sizeof(key), "%s-%s", transport, path && *path ? path : "default");
+	for(int i = 0; i < len && i < (int)sizeof(key); i++){
+		if(!isalnum((uchar)key[i]) && key[i] != '-' && key[i] != '.')
+			key[i] = '_';
+	}
+
+	dir = getenv("XBIT_CACHE_DIR");
+	if(dir && *dir)
+		len = snprintf(filename, size, "%s", dir);
+	else {
+		dir = getenv("HOME");
+		if(!dir)
+			dir = getenv("USERPROFILE");
+		len = snprintf(filename, size, "%s/" CACHE_DIR, dir ? dir : ".");
+	}
+	if(len >= size)
+		return false;
+#ifdef WIN32
+	_mkdir(filename);
+#else
+	mkdir(filename, 0755);
+#endif
+	return snprintf(filename + len, size - len, "/%s%s", key, ext) < size - len;
+}
+
+// e.g. ~/.xbit_cache/hid-1-2_1.0
+bool BlockCache::Load(const char *transport, const char *path, int layout)
+{
+	CACHE_HEADER header;
+	FILE *f;
+
+	this->loaded = false;
+	if(!this->enabled)
+		return false;
+
+	if(!state_path(transport, path, "", this->filename, sizeof(this->filename))){
+		log_printf("Cache: path too long, not caching\n");
+		return false;
+	}
+
+	Clear(layout);
+	this->loaded = true;
+	f = fopen(this->filename, "rb");
+	if(f == NULL)
+		return true;
+
+	if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic))
+		|| header.version != CACHE_VERSION || fread(this->blocks, sizeof(this->blocks), 1, f) != 1){
+		log_printf("Cache: %s is damaged, starting over\n", this->filename);
+		Clear(layout);
+	}
+	else if((int)header.layout != layout){
+		log_printf("Cache: chip was formatted for layout %i elsewhere, starting over\n", layout);
+		Clear(layout);
+	}
+	fclose(f);
+
+	for(int i = 0; i < TOTAL_BLOCKS; i++)
+		this->blocks[i].checked = 0;
+	return true;
+}
+
+// Into a temporary file first, a failed write must not leave a torn cache behind
+bool BlockCache::Save()
+{
+	CACHE_HEADER header;
+	char temp[MAX_STR + 4];
+	FILE *f;
+	bool res;
+
+	if(!this->loaded || !this->dirty)
+		return true;
+
+	snprintf(temp, sizeof(temp), "%s.tmp", this->filename);
+	f = fopen(temp, "wb");
+	if(f == NULL){
+		log_printf("Cache: failed to write %s\n", temp);
+		return false;
+	}
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.layout = this->layout;
+	res = fwrite(&header, sizeof(header), 1, f) == 1;
+	res = fwrite(this->blocks, sizeof(this->blocks), 1, f) == 1 && res;
+	res = fclose(f) == 0 && res;
+#ifdef WIN32
+	if(res)
+		remove(this->filename);
+#endif
+	if(!res || rename(temp, this->filename)){
+		log_printf("Cache: failed to write %s\n", this->filename);
+		remove(temp);
+		return false;
+	}
+	this->dirty = false;
+	return true;
+}
+
+void BlockCache::Clear(int layout)
+{
+	memset(this->blocks, 0, sizeof(this->blocks));
+	this->layout = layout;
+	this->dirty = true;
+}
+
+void BlockCache::SetLayout(int layout)
+{
+	this->layout = layout;
+	this->dirty = true;
+}
+
+void BlockCache::Invalidate(int block)
+{
+	if(!this->blocks[block].valid)
+		return;
+	this->blocks[block].valid = 0;
+	this->dirty = true;
+	Save();
+}
+
+void BlockCache::InvalidateBlocks(int start_block, int block_count, const bool *which)
+{
+	for(int i = 0; i < block_count; i++){
+		if(which[i] && this->blocks[start_block + i].valid){
+			this->blocks[start_block + i].valid = 0;
+			this->dirty = true;
+		}
+	}
+	Save();
+}
+
+void BlockCache::Store(int block, const uchar *digest, const uchar *sample)
+{
+	CACHE_BLOCK *entry = &this->blocks[block];
+
+	if(!this->loaded)
+		return;
+	entry->valid = 1;
+	entry->checked = 1;
+	memcpy(entry->digest, digest, SHA256_SIZE);
+	memcpy(entry->sample, sample, CACHE_SAMPLE);
+	this->dirty = true;
+}
+
+void BlockCache::StoreData(int block, const uchar *data)
+{
+	uchar digest[SHA256_SIZE];
+
+	if(!this->loaded)
+		return;
+	sha256(data, BLOCK_SIZE, digest);
+	Store(block, digest, &data[SampleOffset(block)]);
+}
+
+void BlockCache::StoreBlank(int block)
+{
+	uchar sample[CACHE_SAMPLE];
+
+	memset(sample, 0xFF, sizeof(sample));
+	Store(block, this->blank_digest, sample);
+}
+
+// Known and allowed to be used instead of asking the chip
+bool BlockCache::IsUsable(int block)
+{
+	return this->loaded && !this->strict && this->blocks[block].valid;
+}
+
+bool BlockCache::NeedsCheck(int block)
+{
+	return !this->blocks[block].checked;
+}
+
+bool BlockCache::Check(int block, const uchar *sample)
+{
+	if(memcmp(this->blocks[block].sample, sample, CACHE_SAMPLE))
+		return false;
+	this->blocks[block].checked = 1;
+	return true;
+}
+
+const uchar *BlockCache::GetDigest(int block)
+{
+	return this->blocks[block].digest;
+}
+
+bool BlockCache::IsBlank(int block)
+{
+	return !memcmp(this->blocks[block].digest, this->blank_digest, SHA256_SIZE);
+}
@@ -0,0 +1,127 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Transfer mode calibration
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+#include "transport.h"
+
+// Slowest first, a path is not tried any faster once it failed
+static const int calibration_pacing_us[] = {PACING_START_US, 4000, 2000, 1000, 500, PACING_MIN_US};
+
+///////////////// Class
+// One status round trip and a short read, checked against what the default path read
+bool XbitFlasher::CalibrationRound(int round, const uchar *reference, int *rtt_us)
+{
+	uchar buffer[CALIBRATION_READ];
+	unsigned long long start;
+
+	start = get_time_us();
+	if(!GetStatus() || !IsValidStatus() || GetCurrentCommand() != 0)
+		return false;
+	*rtt_us = (int)(get_time_us() - start) - this->pacer.GetDelay();
+	if(!ReadFlash(PRIMARY_FLASH, 0, round * CALIBRATION_READ, buffer, CALIBRATION_READ))
+		return false;
+	return !memcmp(buffer, &reference[round * CALIBRATION_READ], CALIBRATION_READ);
+}
+
+// After a failed round: back on the default path, drain what the chip still wants to send
+void XbitFlasher::Settle()
+{
+	this->transport->SetModes(XFER_OUT_REPORT, XFER_IN_FEATURE);
+	this->pacer.SetStart(PACING_START_US);
+	for(int i = 0; i <= CALIBRATION_READ / (CMD_SIZE - 1); i++){
+		if(GetStatus() && IsValidStatus() && GetCurrentCommand() == 0)
+			return;
+	}
+}
+
+// Runs a read-only status + read workload over every report path and pacing,
+// the fastest combination that went through without a single failure goes into the profile
+bool XbitFlasher::Calibrate()
+{
+	uchar reference[CALIBRATION_ROUNDS * CALIBRATION_READ];
+	PROFILE best, cal;
+	int rounds, rtt_us, rtt_total;
+	unsigned long long start;
+	bool found = false;
+
+	// What the chip holds, read over the path that always worked
+	this->transport->SetModes(XFER_OUT_REPORT, XFER_IN_FEATURE);
+	this->pacer.SetStart(PACING_START_US);
+	if(!GetBus())
+		return false;
+	if(!ReadFlash(PRIMARY_FLASH, 0, 0, reference, sizeof(reference))){
+		log_printf("Calibration: reading the reference over the default path failed\n");
+		ReleaseBus();
+		return false;
+	}
+
+	log_printf("Calibration: %i rounds of status + %i byte read per path and pacing\n", CALIBRATION_ROUNDS, CALIBRATION_READ);
+	log_printf("  %-8s %-10s %8s %7s %8s %9s\n", "OUT", "IN", "pacing", "ok", "rtt", "round");
+	for(int out = 0; out < XFER_OUT_COUNT; out++){
+		for(int in = 0; in < XFER_IN_COUNT; in++){
+			if(!this->transport->SetModes(out, in)){
+				log_printf("  %-8s %-10s not available on %s\n", xfer_out_names[out], xfer_in_names[in], this->transport->GetName());
+				continue;
+			}
+			for(int p = 0; p < (int)(sizeof(calibration_pacing_us) / sizeof(calibration_pacing_us[0])); p++){
+				this->transport->SetModes(out, in);
+				this->pacer.SetStart(calibration_pacing_us[p]);
+				rtt_total = 0;
+				start = get_time_us();
+				for(rounds = 0; rounds < CALIBRATION_ROUNDS; rounds++){
+					if(!CalibrationRound(rounds, reference, &rtt_us))
+						break;
+					rtt_total += rtt_us;
+				}
+				cal.out_mode = out;
+				cal.in_mode = in;
+				cal.pacing_us = calibration_pacing_us[p];
+				cal.round_us = (int)((get_time_us() - start) / (rounds ? rounds : 1));
+				log_printf("  %-8s %-10s %5i us %3i/%-3i %5i us %6.1f ms\n", xfer_out_names[out], xfer_in_names[in], cal.pacing_us,
+					rounds, CALIBRATION_ROUNDS, rounds ? rtt_total / rounds : 0, cal.round_us / 1000.0);
+				if(rounds < CALIBRATION_ROUNDS){
+					Settle();
+					break;
+				}
+				if(!found || cal.round_us < best.round_us){
+					best = cal;
+					found = true;
+				}
+			}
+		}
+	}
+
+	this->transport->SetModes(XFER_OUT_REPORT, XFER_IN_FEATURE);
+	this->pacer.SetStart(PACING_START_US);
+	ReleaseBus();
+	if(!found){
+		log_printf("Calibration: no path came through without failures, keeping the defaults\n");
+		return false;
+	}
+	log_printf("Calibration: fastest reliable path is %s OUT, %s IN at %i us pacing, %.1f ms per round\n",
+		xfer_out_names[best.out_mode], xfer_in_names[best.in_mode], best.pacing_us, best.round_us / 1000.0);
+
+	this->profile.out_mode = best.out_mode;
+	this->profile.in_mode = best.in_mode;
+	this->profile.pacing_us = best.pacing_us;
+	this->profile.round_us = best.round_us;
+	this->profile.calibrated_us = best.pacing_us;
+	this->profile.bad_runs = 0;
+	if(!ApplyProfile())
+		return false;
+	if(!this->profile_file[0]){
+		log_printf("Calibration: not saved, profiles are turned off\n");
+		return true;
+	}
+	if(!ProfileSave(&this->profile, this->profile_file)){
+		log_printf("Calibration: failed to write %s\n", this->profile_file);
+		return false;
+	}
+	log_printf("Calibration: saved to %s\n", this->profile_file);
+	return true;
+}
@@ -0,0 +1,276 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Digests
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+///////////////// SHA-256 (FIPS 180-4)
+static const uint32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_block(SHA256_CTX *ctx, const uchar *data)
+{
+	uint32 w[64], a, b, c, d, e, f, g, h, t1, t2;
+
+	for(int i = 0; i < 16; i++)
+		w[i] = (data[i * 4] << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+	for(int i = 16; i < 64; i++)
+		w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+			+ w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+	for(int i = 0; i < 64; i++){
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(SHA256_CTX *ctx)
+{
+	static const uint32 init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, init, sizeof(ctx->state));
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+void sha256_update(SHA256_CTX *ctx, const uchar *data, int length)
+{
+	int count;
+
+	ctx->length += length;
+	if(ctx->used){
+		count = length < 64 - ctx->used ? length : 64 - ctx->used;
+		memcpy(ctx->buffer + ctx->used, data, count);
+		ctx->used += count;
+		data += count;
+		length -= count;
+		if(ctx->used < 64)
+			return;
+		sha256_block(ctx, ctx->buffer);
+		ctx->used = 0;
+	}
+	for(; length >= 64; data += 64, length -= 64)
+		sha256_block(ctx, data);
+	memcpy(ctx->buffer, data, length);
+	ctx->used = length;
+}
+
+void sha256_final(SHA256_CTX *ctx, uchar *digest)
+{
+	unsigned long long bits = ctx->length * 8;
+
+	ctx->buffer[ctx->used++] = 0x80;
+	if(ctx->used > 56){
+		memset(ctx->buffer + ctx->used, 0, 64 - ctx->used);
+		sha256_block(ctx, ctx->buffer);
+		ctx->used = 0;
+	}
+	memset(ctx->buffer + ctx->used, 0, 56 - ctx->used);
+	for(int i = 0; i < 8; i++)
+		ctx->buffer[63 - i] = (uchar)(bits >> (i * 8));
+	sha256_block(ctx, ctx->buffer);
+
+	for(int i = 0; i < 8; i++){
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
+
+void sha256(const uchar *data, int length, uchar *digest)
+{
+	SHA256_CTX ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, length);
+	sha256_final(&ctx, digest);
+}
+
+///////////////// CRC-32 (IEEE 802.3, as zlib)
+static uint32 crc32_table[256];
+
+static void crc32_init()
+{
+	uint32 c;
+
+	for(uint32 i = 0; i < 256; i++){
+		c = i;
+		for(int k = 0; k < 8; k++)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+uint32 crc32_update(uint32 crc, const uchar *data, int length)
+{
+	static bool initialized = (crc32_init(), true);
+
+	(void)initialized;
+	crc = ~crc;
+	for(int i = 0; i < length; i++)
+		crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+///////////////// Digest files
+void DigestsInit(IMAGE_DIGESTS *digests, int layout, int bank)
+{
+	memset(digests, 0, sizeof(IMAGE_DIGESTS));
+	digests->layout = layout;
+	digests->bank = bank;
+	sha256_init(&digests->block_ctx);
+	sha256_init(&digests->image_ctx);
+}
+
+void DigestsUpdate(IMAGE_DIGESTS *digests, const uchar *data, int length)
+{
+	int block, count;
+
+	sha256_update(&digests->image_ctx, data, length);
+	digests->image_crc = crc32_update(digests->image_crc, data, length);
+	while(length > 0){
+		block = digests->size / BLOCK_SIZE;
+		count = BLOCK_SIZE - digests->size % BLOCK_SIZE;
+		if(count > length)
+			count = length;
+		if(block >= TOTAL_BLOCKS)
+			return;
+		sha256_update(&digests->block_ctx, data, count);
+		digests->block_crc[block] = crc32_update(digests->block_crc[block], data, count);
+		digests->size += count;
+		data += count;
+		length -= count;
+		if(digests->size % BLOCK_SIZE == 0){
+			sha256_final(&digests->block_ctx, digests->block_sha[block]);
+			sha256_init(&digests->block_ctx);
+		}
+	}
+}
+
+void DigestsFinal(IMAGE_DIGESTS *digests)
+{
+	sha256_final(&digests->image_ctx, digests->image_sha);
+}
+
+static void print_hex(FILE *f, const uchar *data, int length)
+{
+	for(int i = 0; i < length; i++)
+		fprintf(f, "%02x", data[i]);
+}
+
+static bool parse_hex(const char *hex, uchar *data, int length)
+{
+	unsigned int byte;
+
+	if((int)strlen(hex) != length * 2)
+		return false;
+	for(int i = 0; i < length; i++){
+		if(sscanf(&hex[i * 2], "%2x", &byte) != 1)
+			return false;
+		data[i] = byte;
+	}
+	return true;
+}
+
+bool DigestsSave(const IMAGE_DIGESTS *digests, const char *filename)
+{
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if(f == NULL)
+		return false;
+
+	fprintf(f, "%s %i\n", DIGEST_FILE_MAGIC, DIGEST_FILE_VERSION);
+	fprintf(f, "layout %i\nbank %i\nsize %i\n", digests->layout, digests->bank, digests->size);
+	fprintf(f, "image %08x ", digests->image_crc);
+	print_hex(f, digests->image_sha, SHA256_SIZE);
+	fprintf(f, "\n");
+	for(int block = 0; block < digests->size / BLOCK_SIZE; block++){
+		fprintf(f, "block %i %08x ", block, digests->block_crc[block]);
+		print_hex(f, digests->block_sha[block], SHA256_SIZE);
+		fprintf(f, "\n");
+	}
+	return fclose(f) == 0;
+}
+
+bool DigestsLoad(IMAGE_DIGESTS *digests, const char *filename)
+{
+	char line[256], word[16], hex[2 * SHA256_SIZE + 4];
+	int version, value, blocks = 0;
+	uint32 crc;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if(f == NULL)
+		return false;
+
+	DigestsInit(digests, 0, 0);
+	if(!fgets(line, sizeof(line), f) || sscanf(line, "%15s %i", word, &version) != 2
+		|| strcmp(word, DIGEST_FILE_MAGIC) || version != DIGEST_FILE_VERSION){
+		fclose(f);
+		return false;
+	}
+	while(fgets(line, sizeof(line), f)){
+		if(sscanf(line, "layout %i", &value) == 1)
+			digests->layout = value;
+		else if(sscanf(line, "bank %i", &value) == 1)
+			digests->bank = value;
+		else if(sscanf(line, "size %i", &value) == 1)
+			digests->size = value;
+		else if(sscanf(line, "image %x %66s", &crc, hex) == 2 && parse_hex(hex, digests->image_sha, SHA256_SIZE))
+			digests->image_crc = crc;
+		else if(sscanf(line, "block %i %x %66s", &value, &crc, hex) == 3 && value == blocks && value < TOTAL_BLOCKS
+			&& parse_hex(hex, digests->block_sha[value], SHA256_SIZE)){
+			digests->block_crc[value] = crc;
+			blocks++;
+		}
+		else {
+			log_printf("%s: cannot parse: %s", filename, line);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+
+	if(digests->size <= 0 || digests->size % BLOCK_SIZE || blocks != digests->size / BLOCK_SIZE){
+		log_printf("%s: block digests do not cover %i bytes\n", filename, digests->size);
+		return false;
+	}
+	return true;
+}
+
+bool IsDigestFile(const char *filename)
+{
+	char magic[sizeof(DIGEST_FILE_MAGIC)];
+	FILE *f;
+	bool res;
+
+	f = fopen(filename, "r");
+	if(f == NULL)
+		return false;
+	res = fread(magic, sizeof(magic) - 1, 1, f) == 1 && !memcmp(magic, DIGEST_FILE_MAGIC, sizeof(magic) - 1);
+	fclose(f);
+	return res;
+}
@@ -0,0 +1,426 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Device emulator
+ *
+ * Models the DK3200/X-BIT firmware closely enough to run the flasher
+ * without a chip: 2 MB of NOR flash (writes can only clear bits),
+ * erases that keep the MCU busy, a bus that has to be acquired and
+ * the faults seen on real host controllers.
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+
+#include "emulator.h"
+
+#define SWAP_UINT16(x) ((((x)&0xff00)>>8) | (((x)&0x00ff)<<8))
+
+#define FLASH_SIZE		(TOTAL_BLOCKS * BLOCK_SIZE)
+#define RET_ERROR		0xFF
+
+static unsigned long long emu_time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int env_int(const char *name, int def)
+{
+	const char *value = getenv(name);
+	return (value && *value) ? atoi(value) : def;
+}
+
+void EmuConfigDefaults(EMU_CONFIG *config)
+{
+	memset(config, 0, sizeof(EMU_CONFIG));
+	config->erase_ms = 100;
+	config->report_checksum = true;
+	config->seed = 1;
+	config->page = 5;
+}
+
+void EmuConfigFromEnv(EMU_CONFIG *config, int index)
+{
+	const char *image;
+
+	EmuConfigDefaults(config);
+	config->latency_us = env_int("XBIT_EMU_LATENCY_US", config->latency_us);
+	config->erase_ms = env_int("XBIT_EMU_ERASE_MS", config->erase_ms);
+	config->min_gap_us = env_int("XBIT_EMU_MIN_GAP_US", config->min_gap_us);
+	config->interrupt_us = env_int("XBIT_EMU_INTERRUPT_US", config->interrupt_us);
+	config->write_protect = env_int("XBIT_EMU_WP", 0) != 0;
+	config->report_checksum = env_int("XBIT_EMU_CHECKSUM", 1) != 0;
+	config->drop_ppm = env_int("XBIT_EMU_DROP_PPM", 0);
+	config->bad_checksum_ppm = env_int("XBIT_EMU_BAD_CSUM_PPM", 0);
+	config->bad_mfg_ppm = env_int("XBIT_EMU_BAD_MFG_PPM", 0);
+	config->seed = env_int("XBIT_EMU_SEED", config->seed) + index;
+	config->page = env_int("XBIT_EMU_PAGE", config->page);
+
+	// Every emulated chip gets its own backing file
+	image = getenv("XBIT_EMU_IMAGE");
+	if(image && *image){
+		if(index)
+			snprintf(config->image, sizeof(config->image), "%s.%i", image, index);
+		else
+			snprintf(config->image, sizeof(config->image), "%s", image);
+	}
+}
+
+static XbitEmulator *emu_devices[EMU_MAX_DEVICES];
+static int emu_device_count = 0;
+static int emu_attached = 0;
+
+void EmuAttach()
+{
+	EMU_CONFIG config;
+
+	if(emu_attached++)
+		return;
+
+	emu_device_count = env_int("XBIT_EMU_DEVICES", 1);
+	if(emu_device_count < 0)
+		emu_device_count = 0;
+	if(emu_device_count > EMU_MAX_DEVICES)
+		emu_device_count = EMU_MAX_DEVICES;
+
+	for(int i = 0; i < emu_device_count; i++){
+		EmuConfigFromEnv(&config, i);
+		emu_devices[i] = new XbitEmulator(&config);
+	}
+}
+
+void EmuDetach()
+{
+	if(!emu_attached || --emu_attached)
+		return;
+
+	for(int i = 0; i < emu_device_count; i++){
+		if(getenv("XBIT_EMU_STATS"))
+			emu_devices[i]->PrintStats();
+		delete emu_devices[i];
+		emu_devices[i] = NULL;
+	}
+	emu_device_count = 0;
+}
+
+int EmuGetDeviceCount()
+{
+	return emu_device_count;
+}
+
+XbitEmulator *EmuGetDevice(int index)
+{
+	if(index < 0 || index >= emu_device_count)
+		return NULL;
+	return emu_devices[index];
+}
+
+XbitEmulator::XbitEmulator(const EMU_CONFIG *config)
+{
+	this->config = *config;
+	memset(&this->stats, 0, sizeof(this->stats));
+
+	this->flash = (uchar *)malloc(FLASH_SIZE);
+	memset(this->flash, 0xFF, FLASH_SIZE);
+	this->current_cmd = 0;
+	this->page = config->page;
+	this->vm = 0;
+	this->ret = STATUS_RET_OK;
+	this->checksum = 0;
+	this->busy_until_us = 0;
+	this->last_report_us = 0;
+	// Spread the seed over all bits, xorshift starts out with small numbers otherwise
+	this->rng = (config->seed + 1) * 2654435761u ^ 0x9E3779B9;
+	if(!this->rng)
+		this->rng = 1;
+	this->xfer_block = 0;
+	this->xfer_offset = 0;
+	this->xfer_remaining = 0;
+
+	if(this->config.image[0])
+		Load(this->config.image);
+}
+
+XbitEmulator::~XbitEmulator()
+{
+	if(this->config.image[0])
+		Save(this->config.image);
+	free(this->flash);
+}
+
+bool XbitEmulator::Chance(int ppm)
+{
+	if(ppm <= 0)
+		return false;
+	// xorshift32, same sequence for the same seed
+	this->rng ^= this->rng << 13;
+	this->rng ^= this->rng >> 17;
+	this->rng ^= this->rng << 5;
+	return (int)(this->rng % 1000000) < ppm;
+}
+
+bool XbitEmulator::IsBusy()
+{
+	if(this->busy_until_us && emu_time_us() >= this->busy_until_us){
+		this->busy_until_us = 0;
+		this->current_cmd = 0;
+	}
+	return this->busy_until_us != 0;
+}
+
+int XbitEmulator::Write(const uchar *data, int length)
+{
+	if(this->config.latency_us)
+		usleep(this->config.latency_us);
+	return Output(data, length, true);
+}
+
+int XbitEmulator::WriteFeature(const uchar *data, int length)
+{
+	if(this->config.latency_us)
+		usleep(this->config.latency_us);
+	return Output(data, length, false);
+}
+
+// Queued transfers go out back to back, the round trip is paid once per depth reports
+int XbitEmulator::WriteBurst(const uchar *reports, int length, int count, int depth)
+{
+	for(int i = 0; i < count; i++){
+		if(i % depth == 0 && this->config.latency_us)
+			usleep(this->config.latency_us);
+		if(Output(&reports[i * length], length, true) != length)
+			return i;
+	}
+	return count;
+}
+
+int XbitEmulator::Output(const uchar *data, int length, bool paced)
+{
+	REPORT_BUF report;
+	unsigned long long now;
+
+	if(length != sizeof(REPORT_BUF))
+		return -1;
+	this->stats.reports_out++;
+
+	// Lost on the way: the host never knows
+	now = emu_time_us();
+	if((paced && this->config.min_gap_us && now - this->last_report_us < (unsigned long long)this->config.min_gap_us)
+		|| Chance(this->config.drop_ppm)){
+		this->last_report_us = now;
+		this->stats.dropped++;
+		return length;
+	}
+	this->last_report_us = now;
+
+	memcpy(&report, data, sizeof(REPORT_BUF));
+	if(report.report.u.cmd == 0)
+		Data(&report.report);
+	else
+		Command(&report.report);
+	return length;
+}
+
+void XbitEmulator::Command(PMCU_CMD cmd)
+{
+	int block, offset, count;
+
+	if(cmd->u.cmd == CMD_GET_STATUS){
+		IsBusy();
+		return;
+	}
+
+	// The MCU does not listen while the flash is erasing
+	if(IsBusy()){
+		this->stats.busy_violations++;
+		return;
+	}
+
+	// A new command ends whatever transfer was running, and reports its own result
+	this->xfer_remaining = 0;
+	this->current_cmd = 0;
+	this->ret = STATUS_RET_OK;
+
+	switch(cmd->u.cmd){
+		case CMD_RESET:
+			this->vm = 0;
+			break;
+		case CMD_SET_VM:
+			this->vm = cmd->u.setRegs.vm & (STATUS_BUS_FREE | STATUS_BUS_ATTACHED);
+			break;
+		case CMD_SET_PAGE:
+			this->page = cmd->u.setRegs.page;
+			break;
+		case CMD_ERASE:
+			block = cmd->u.erase.flash;
+			if(!(this->vm & STATUS_BUS_FREE) || this->config.write_protect || block >= TOTAL_BLOCKS){
+				this->stats.rejected++;
+				this->ret = RET_ERROR;
+				break;
+			}
+			memset(&this->flash[block * BLOCK_SIZE], 0xFF, BLOCK_SIZE);
+			this->stats.erases++;
+			this->current_cmd = CMD_ERASE;
+			this->busy_until_us = emu_time_us() + (unsigned long long)this->config.erase_ms * 1000;
+			if(!this->busy_until_us)
+				this->busy_until_us = 1;
+			break;
+		case CMD_WRITE:
+		case CMD_READ:
+			block = cmd->u.rw.flash;
+			offset = SWAP_UINT16(cmd->u.rw.address);
+			count = SWAP_UINT16(cmd->u.rw.nBytes);
+			if(!(this->vm & STATUS_BUS_FREE) || block >= TOTAL_BLOCKS || offset + count > BLOCK_SIZE
+				|| (cmd->u.cmd == CMD_WRITE && this->config.write_protect)){
+				this->stats.rejected++;
+				this->ret = RET_ERROR;
+				break;
+			}
+			this->checksum = 0;
+			this->current_cmd = cmd->u.cmd;
+			this->xfer_block = block;
+			this->xfer_offset = offset;
+			this->xfer_remaining = count;
+			break;
+		default:
+			this->stats.rejected++;
+			this->ret = RET_ERROR;
+			break;
+	}
+}
+
+void XbitEmulator::Data(PMCU_CMD cmd)
+{
+	uchar *dest;
+	uchar byte;
+	int count;
+
+	if(this->current_cmd != CMD_WRITE || !this->xfer_remaining){
+		this->stats.rejected++;
+		return;
+	}
+
+	count = this->xfer_remaining < CMD_SIZE - 1 ? this->xfer_remaining : CMD_SIZE - 1;
+	dest = &this->flash[this->xfer_block * BLOCK_SIZE + this->xfer_offset];
+	if(Chance(this->config.bad_checksum_ppm)){
+		cmd->u.buffer[1 + this->rng % count] ^= 0x5A;
+		this->stats.corrupted++;
+	}
+	for(int i = 0; i < count; i++){
+		byte = cmd->u.buffer[1 + i];
+		dest[i] &= byte;	// NOR flash: programming only clears bits
+		this->checksum += byte;
+	}
+	this->xfer_offset += count;
+	this->xfer_remaining -= count;
+	this->stats.bytes_written += count;
+	if(!this->xfer_remaining)
+		this->current_cmd = 0;
+}
+
+int XbitEmulator::GetFeature(uchar *data, int length)
+{
+	if(this->config.latency_us)
+		usleep(this->config.latency_us);
+	return Input(data, length);
+}
+
+// Polled at the endpoint interval instead of a control round trip
+int XbitEmulator::ReadInput(uchar *data, int length)
+{
+	if(!this->config.interrupt_us)
+		return 0;
+	usleep(this->config.interrupt_us);
+	return Input(data, length);
+}
+
+int XbitEmulator::Input(uchar *data, int length)
+{
+	REPORT_BUF report;
+	int count;
+
+	if(length < (int)sizeof(REPORT_BUF))
+		return -1;
+	this->stats.reports_in++;
+
+	memset(&report, 0, sizeof(REPORT_BUF));
+	if(this->current_cmd == CMD_READ && this->xfer_remaining){
+		count = this->xfer_remaining < CMD_SIZE - 1 ? this->xfer_remaining : CMD_SIZE - 1;
+		memcpy(report.report.u.buffer + 1, &this->flash[this->xfer_block * BLOCK_SIZE + this->xfer_offset], count);
+		this->xfer_offset += count;
+		this->xfer_remaining -= count;
+		this->stats.bytes_read += count;
+		if(!this->xfer_remaining)
+			this->current_cmd = 0;
+	}
+	else {
+		IsBusy();
+		report.report.u.status.cmd = CMD_GET_STATUS;
+		report.report.u.status.currentCmd = this->current_cmd;
+		report.report.u.status.page = this->page;
+		report.report.u.status.vm = this->vm | (this->config.write_protect ? STATUS_WRITE_PROTECT : 0);
+		report.report.u.status.ret = this->ret;
+		report.report.u.status.checkSum = this->config.report_checksum ? this->checksum : 0;
+	}
+	memcpy(data, &report, sizeof(REPORT_BUF));
+	return sizeof(REPORT_BUF);
+}
+
+const wchar_t *XbitEmulator::GetManufacturer()
+{
+	if(Chance(this->config.bad_mfg_ppm))
+		return L"ST Micrnics";
+	return DEVICE_MFG;
+}
+
+const wchar_t *XbitEmulator::GetProduct()
+{
+	return DEVICE_PRODUCT;
+}
+
+uchar *XbitEmulator::GetFlash()
+{
+	return this->flash;
+}
+
+bool XbitEmulator::Load(const char *filename)
+{
+	FILE *f;
+	char magic[4];
+	uchar page;
+	bool res;
+
+	f = fopen(filename, "rb");
+	if(!f)
+		return false;
+	res = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, EMU_IMAGE_MAGIC, sizeof(magic))
+		&& fread(&page, 1, 1, f) == 1 && fread(this->flash, FLASH_SIZE, 1, f) == 1;
+	fclose(f);
+	if(res)
+		this->page = page;
+	return res;
+}
+
+bool XbitEmulator::Save(const char *filename)
+{
+	FILE *f;
+	bool res;
+
+	f = fopen(filename, "wb");
+	if(!f)
+		return false;
+	res = fwrite(EMU_IMAGE_MAGIC, 4, 1, f) == 1 && fwrite(&this->page, 1, 1, f) == 1
+		&& fwrite(this->flash, FLASH_SIZE, 1, f) == 1;
+	fclose(f);
+	return res;
+}
+
+void XbitEmulator::PrintStats()
+{
+	fprintf(stderr, "Emulator: %lu reports out, %lu in, %lu dropped, %lu corrupted, %lu busy violations, %lu rejected, %lu erases\n",
+		this->stats.reports_out, this->stats.reports_in, this->stats.dropped, this->stats.corrupted,
+		this->stats.busy_violations, this->stats.rejected, this->stats.erases);
+}
@@ -0,0 +1,99 @@
+#ifndef _EMULATOR_H
+#define _EMULATOR_H
+
+#include "xbit.h"
+
+// Software model of the DK3200/X-BIT firmware, speaks the same
+// MCU_CMD/REPORT_BUF framing as the real chip
+
+#define EMU_MAX_DEVICES			16
+#define EMU_PATH_PREFIX			"xbit-emu:"
+#define EMU_IMAGE_MAGIC			"XEMU"
+
+typedef struct
+{
+	int latency_us;				// Added to every report, both directions
+	int erase_ms;				// How long CMD_ERASE keeps the MCU busy
+	int min_gap_us;				// Output reports closer than this get lost (flaky host controller), SET_REPORT Feature does not
+	int interrupt_us;			// Interval of the interrupt IN endpoint, 0 if the firmware only answers GET_REPORT
+	bool write_protect;
+	bool report_checksum;		// The real X-BIT seems to leave the checksum at 0
+	int drop_ppm;			// Chance to lose an output report
+	int bad_checksum_ppm;	// Chance to corrupt a data byte on the wire
+	int bad_mfg_ppm;		// Chance to garble the manufacturer string ("ST Micrnics")
+	unsigned int seed;
+	int page;					// Layout the chip starts with
+	char image[MAX_STR];		// Backing file for the flash contents, empty for none
+} EMU_CONFIG;
+
+typedef struct
+{
+	unsigned long reports_out;	// Host -> MCU
+	unsigned long reports_in;	// MCU -> host
+	unsigned long dropped;
+	unsigned long corrupted;
+	unsigned long busy_violations;	// Commands sent while an erase was running
+	unsigned long rejected;		// Commands refused (no bus, write protect, bad range)
+	unsigned long erases;
+	unsigned long bytes_written;
+	unsigned long bytes_read;
+} EMU_STATS;
+
+void EmuConfigDefaults(EMU_CONFIG *config);
+void EmuConfigFromEnv(EMU_CONFIG *config, int index);
+
+class XbitEmulator;
+
+// The emulated chips of this process, created from the environment on first attach
+void EmuAttach();
+void EmuDetach();
+int EmuGetDeviceCount();
+XbitEmulator *EmuGetDevice(int index);
+
+class XbitEmulator
+{
+public:
+	EMU_CONFIG config;
+	EMU_STATS stats;
+
+	XbitEmulator(const EMU_CONFIG *config);
+	~XbitEmulator();
+
+	int Write(const uchar *data, int length);			// Output report, host -> MCU
+	int WriteFeature(const uchar *data, int length);	// Feature report via the control pipe, host -> MCU
+	int WriteBurst(const uchar *reports, int length, int count, int depth);	// Output reports, depth of them in flight
+	int GetFeature(uchar *data, int length);			// Feature report, MCU -> host
+	int ReadInput(uchar *data, int length);				// Input report from the interrupt endpoint, 0 if there is none
+	const wchar_t *GetManufacturer();
+	const wchar_t *GetProduct();
+
+	bool Load(const char *filename);
+	bool Save(const char *filename);
+	uchar *GetFlash();
+	void PrintStats();
+
+private:
+	uchar *flash;				// TOTAL_BLOCKS * BLOCK_SIZE
+	uchar current_cmd;
+	uchar page;
+	uchar vm;
+	uchar ret;
+	uchar checksum;
+	unsigned long long busy_until_us;
+	unsigned long long last_report_us;
+	unsigned int rng;
+
+	// Running CMD_WRITE/CMD_READ
+	int xfer_block;
+	int xfer_offset;
+	int xfer_remaining;
+
+	bool Chance(int ppm);
+	bool IsBusy();
+	int Output(const uchar *data, int length, bool paced);
+	int Input(uchar *data, int length);
+	void Command(PMCU_CMD cmd);
+	void Data(PMCU_CMD cmd);
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - hidapi stand-in
+ *
+ * Serves the hid_* calls from emulated chips, configured through
+ * XBIT_EMU_* environment variables (see README)
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <wchar.h>
+
+#include "emulator.h"
+
+struct hid_device_
+{
+	XbitEmulator *emu;
+	int index;
+};
+
+int hid_init(void)
+{
+	EmuAttach();
+	return 0;
+}
+
+int hid_exit(void)
+{
+	EmuDetach();
+	return 0;
+}
+
+struct hid_device_info *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_device_info *head = NULL, **tail = &head;
+	char path[MAX_STR];
+
+	for(int i = 0; i < EmuGetDeviceCount(); i++){
+		struct hid_device_info *info = (struct hid_device_info *)calloc(1, sizeof(struct hid_device_info));
+		snprintf(path, sizeof(path), EMU_PATH_PREFIX "%i", i);
+		info->path = strdup(path);
+		info->vendor_id = vendor_id;
+		info->product_id = product_id;
+		info->manufacturer_string = wcsdup(EmuGetDevice(i)->GetManufacturer());
+		info->product_string = wcsdup(EmuGetDevice(i)->GetProduct());
+		*tail = info;
+		tail = &info->next;
+	}
+	return head;
+}
+
+void hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *next;
+	while(devs){
+		next = devs->next;
+		free(devs->path);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs);
+		devs = next;
+	}
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	return hid_open_path(EMU_PATH_PREFIX "0");
+}
+
+hid_device *hid_open_path(const char *path)
+{
+	hid_device *device;
+	int index;
+
+	if(strncmp(path, EMU_PATH_PREFIX, strlen(EMU_PATH_PREFIX)))
+		return NULL;
+	index = atoi(path + strlen(EMU_PATH_PREFIX));
+	if(!EmuGetDevice(index))
+		return NULL;
+
+	device = new hid_device;
+	device->emu = EmuGetDevice(index);
+	device->index = index;
+	return device;
+}
+
+void hid_close(hid_device *device)
+{
+	delete device;
+}
+
+int hid_write(hid_device *device, const unsigned char *data, size_t length)
+{
+	return device->emu->Write(data, length);
+}
+
+int hid_read_timeout(hid_device *device, unsigned char *data, size_t length, int milliseconds)
+{
+	REPORT_BUF report;
+	int res;
+
+	// Like hidapi for a device without report IDs: the report without the ID byte, 0 on timeout
+	res = device->emu->ReadInput((unsigned char *)&report, sizeof(report));
+	if(res <= 1)
+		return res;
+	res = (int)length < res - 1 ? (int)length : res - 1;
+	memcpy(data, (unsigned char *)&report + 1, res);
+	return res;
+}
+
+int hid_read(hid_device *device, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(device, data, length, -1);
+}
+
+int hid_send_feature_report(hid_device *device, const unsigned char *data, size_t length)
+{
+	return device->emu->WriteFeature(data, length);
+}
+
+int hid_get_feature_report(hid_device *device, unsigned char *data, size_t length)
+{
+	return device->emu->GetFeature(data, length);
+}
+
+int hid_get_manufacturer_string(hid_device *device, wchar_t *string, size_t maxlen)
+{
+	swprintf(string, maxlen, L"%ls", device->emu->GetManufacturer());
+	return 0;
+}
+
+int hid_get_product_string(hid_device *device, wchar_t *string, size_t maxlen)
+{
+	swprintf(string, maxlen, L"%ls", device->emu->GetProduct());
+	return 0;
+}
+
+int hid_get_serial_number_string(hid_device *device, wchar_t *string, size_t maxlen)
+{
+	swprintf(string, maxlen, L"EMU%04i", device->index);
+	return 0;
+}
+
+const wchar_t *hid_error(hid_device *device)
+{
+	return L"Emulated device error";
+}
@@ -0,0 +1,44 @@
+#ifndef _HIDEMU_H
+#define _HIDEMU_H
+
+// Stand-in for the subset of hidapi the flasher uses, backed by XbitEmulator
+// Build with -DXBIT_EMULATOR to link against this instead of libhidapi
+
+#include <wchar.h>
+#include <stddef.h>
+
+typedef struct hid_device_ hid_device;
+
+struct hid_device_info
+{
+	char *path;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	wchar_t *serial_number;
+	unsigned short release_number;
+	wchar_t *manufacturer_string;
+	wchar_t *product_string;
+	unsigned short usage_page;
+	unsigned short usage;
+	int interface_number;
+	struct hid_device_info *next;
+};
+
+int hid_init(void);
+int hid_exit(void);
+struct hid_device_info *hid_enumerate(unsigned short vendor_id, unsigned short product_id);
+void hid_free_enumeration(struct hid_device_info *devs);
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number);
+hid_device *hid_open_path(const char *path);
+void hid_close(hid_device *device);
+int hid_write(hid_device *device, const unsigned char *data, size_t length);
+int hid_read(hid_device *device, unsigned char *data, size_t length);
+int hid_read_timeout(hid_device *device, unsigned char *data, size_t length, int milliseconds);
+int hid_send_feature_report(hid_device *device, const unsigned char *data, size_t length);
+int hid_get_feature_report(hid_device *device, unsigned char *data, size_t length);
+int hid_get_manufacturer_string(hid_device *device, wchar_t *string, size_t maxlen);
+int hid_get_product_string(hid_device *device, wchar_t *string, size_t maxlen);
+int hid_get_serial_number_string(hid_device *device, wchar_t *string, size_t maxlen);
+const wchar_t *hid_error(hid_device *device);
+
+#endif
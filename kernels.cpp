@@ -0,0 +1,194 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Byte kernels
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+
+// SSE2/AVX2 versions are built with per-function target attributes and picked at runtime,
+// the rest of the tree keeps building for the plain baseline
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+///////////////// Scalar, the reference for the others
+static uchar scalar_sum8(const uchar *data, int length)
+{
+	uchar sum = 0;
+	for(int i = 0; i < length; i++)
+		sum += data[i];
+	return sum;
+}
+
+static bool scalar_is_blank(const uchar *data, int length)
+{
+	for(int i = 0; i < length; i++){
+		if(data[i] != 0xFF)
+			return false;
+	}
+	return true;
+}
+
+static int scalar_find_diff(const uchar *a, const uchar *b, int length)
+{
+	for(int i = 0; i < length; i++){
+		if(a[i] != b[i])
+			return i;
+	}
+	return -1;
+}
+
+#ifdef HAVE_X86_KERNELS
+///////////////// SSE2
+__attribute__((target("sse2")))
+static uchar sse2_sum8(const uchar *data, int length)
+{
+	__m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+	int i = 0;
+
+	// sad against zero adds up 8 bytes into each 64 bit lane
+	for(; i + 16 <= length; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)&data[i]), zero));
+	acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+	return (uchar)(_mm_cvtsi128_si32(acc) + scalar_sum8(&data[i], length - i));
+}
+
+__attribute__((target("sse2")))
+static bool sse2_is_blank(const uchar *data, int length)
+{
+	__m128i ones = _mm_set1_epi8((char)0xFF), all;
+	int i = 0;
+
+	for(; i + 64 <= length; i += 64){
+		all = _mm_and_si128(_mm_and_si128(_mm_loadu_si128((const __m128i *)&data[i]), _mm_loadu_si128((const __m128i *)&data[i + 16])),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)&data[i + 32]), _mm_loadu_si128((const __m128i *)&data[i + 48])));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(all, ones)) != 0xFFFF)
+			return false;
+	}
+	return scalar_is_blank(&data[i], length - i);
+}
+
+__attribute__((target("sse2")))
+static int sse2_find_diff(const uchar *a, const uchar *b, int length)
+{
+	int i = 0, mask, res;
+
+	for(; i + 16 <= length; i += 16){
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&a[i]), _mm_loadu_si128((const __m128i *)&b[i])));
+		if(mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	res = scalar_find_diff(&a[i], &b[i], length - i);
+	return res < 0 ? -1 : i + res;
+}
+
+///////////////// AVX2
+__attribute__((target("avx2")))
+static uchar avx2_sum8(const uchar *data, int length)
+{
+	__m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+	__m128i half;
+	int i = 0;
+
+	for(; i + 32 <= length; i += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)&data[i]), zero));
+	half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	half = _mm_add_epi64(half, _mm_srli_si128(half, 8));
+	return (uchar)(_mm_cvtsi128_si32(half) + scalar_sum8(&data[i], length - i));
+}
+
+__attribute__((target("avx2")))
+static bool avx2_is_blank(const uchar *data, int length)
+{
+	__m256i ones = _mm256_set1_epi8((char)0xFF), all;
+	int i = 0;
+
+	for(; i + 128 <= length; i += 128){
+		all = _mm256_and_si256(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)&data[i]), _mm256_loadu_si256((const __m256i *)&data[i + 32])),
+			_mm256_and_si256(_mm256_loadu_si256((const __m256i *)&data[i + 64]), _mm256_loadu_si256((const __m256i *)&data[i + 96])));
+		if((uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(all, ones)) != 0xFFFFFFFF)
+			return false;
+	}
+	return scalar_is_blank(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static int avx2_find_diff(const uchar *a, const uchar *b, int length)
+{
+	uint32 mask;
+	int i = 0, res;
+
+	for(; i + 32 <= length; i += 32){
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&a[i]), _mm256_loadu_si256((const __m256i *)&b[i])));
+		if(mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	res = scalar_find_diff(&a[i], &b[i], length - i);
+	return res < 0 ? -1 : i + res;
+}
+#endif
+
+///////////////// Dispatch
+static const BYTE_KERNELS kernel_table[] = {
+	{"scalar", scalar_sum8, scalar_is_blank, scalar_find_diff},
+#ifdef HAVE_X86_KERNELS
+	{"sse2", sse2_sum8, sse2_is_blank, sse2_find_diff},
+	{"avx2", avx2_sum8, avx2_is_blank, avx2_find_diff},
+#endif
+};
+
+// What this CPU runs, scalar first and the fastest last
+int byte_kernels_available(const BYTE_KERNELS **list, int max)
+{
+	int count = 0;
+
+	for(int i = 0; i < (int)(sizeof(kernel_table) / sizeof(kernel_table[0])) && count < max; i++){
+#ifdef HAVE_X86_KERNELS
+		if(!strcmp(kernel_table[i].name, "sse2") && !__builtin_cpu_supports("sse2"))
+			continue;
+		if(!strcmp(kernel_table[i].name, "avx2") && !__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		list[count++] = &kernel_table[i];
+	}
+	return count;
+}
+
+// XBIT_KERNELS=scalar|sse2|avx2 pins a set, e.g. to compare them on the same job
+static const BYTE_KERNELS *SelectKernels()
+{
+	const BYTE_KERNELS *list[BYTE_KERNELS_MAX];
+	const char *name = getenv("XBIT_KERNELS");
+	int count = byte_kernels_available(list, BYTE_KERNELS_MAX);
+
+	for(int i = 0; name && i < count; i++){
+		if(!strcmp(list[i]->name, name))
+			return list[i];
+	}
+	return list[count - 1];
+}
+
+const BYTE_KERNELS *byte_kernels()
+{
+	static const BYTE_KERNELS *selected = SelectKernels();
+	return selected;
+}
+
+uchar sum8(const uchar *data, int length)
+{
+	return byte_kernels()->sum8(data, length);
+}
+
+bool is_blank(const uchar *data, int length)
+{
+	return byte_kernels()->is_blank(data, length);
+}
+
+int find_diff(const uchar *a, const uchar *b, int length)
+{
+	return byte_kernels()->find_diff(a, b, length);
+}
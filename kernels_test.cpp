@@ -0,0 +1,103 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Byte kernel test
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+
+#define TEST_SEED			0x5842
+#define TEST_ALIGNS			32		// Every start offset within the widest vector
+#define TEST_LENGTHS		300		// Every length up to this, so every tail is hit
+#define TEST_BUF_SIZE		(TEST_ALIGNS + TEST_LENGTHS + 64)
+
+typedef struct
+{
+	const char *name;
+	uchar (*sum8)(const uchar *data, int length);
+	bool (*is_blank)(const uchar *data, int length);
+	int (*find_diff)(const uchar *a, const uchar *b, int length);
+} KERNEL_SET;
+
+static int failures = 0;
+
+static void Fail(const char *name, const char *op, int align, int length, int pos)
+{
+	if(failures++ < 20)
+		printf("%-10s %-9s differs from scalar: align %i, length %i, position %i\n", name, op, align, length, pos);
+}
+
+// One set against scalar, the bytes around the range are different so nothing reads past the end
+static void CheckSet(const KERNEL_SET *set, const BYTE_KERNELS *ref, uchar *a, uchar *b)
+{
+	uchar *pa, *pb;
+
+	for(int align = 0; align < TEST_ALIGNS; align++){
+		for(int length = 0; length <= TEST_LENGTHS; length++){
+			pa = a + align;
+			pb = b + align;
+
+			// Random bytes for the checksum
+			for(int i = 0; i < TEST_BUF_SIZE; i++)
+				a[i] = rand();
+			if(set->sum8(pa, length) != ref->sum8(pa, length))
+				Fail(set->name, "sum8", align, length, -1);
+
+			// Blank and equal inside, not outside
+			memset(a, 0x00, TEST_BUF_SIZE);
+			memset(b, 0x55, TEST_BUF_SIZE);
+			memset(pa, 0xFF, length);
+			memcpy(pb, pa, length);
+			if(!set->is_blank(pa, length))
+				Fail(set->name, "is_blank", align, length, -1);
+			if(set->find_diff(pa, pb, length) != -1)
+				Fail(set->name, "find_diff", align, length, -1);
+
+			// One byte off at every position
+			for(int pos = 0; pos < length; pos++){
+				pa[pos] = rand() % 0xFF;
+				if(set->is_blank(pa, length))
+					Fail(set->name, "is_blank", align, length, pos);
+				if(set->find_diff(pa, pb, length) != pos)
+					Fail(set->name, "find_diff", align, length, pos);
+				if(set->sum8(pa, length) != ref->sum8(pa, length))
+					Fail(set->name, "sum8", align, length, pos);
+				pa[pos] = 0xFF;
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const BYTE_KERNELS *list[BYTE_KERNELS_MAX];
+	int count = byte_kernels_available(list, BYTE_KERNELS_MAX);
+	KERNEL_SET set;
+	uchar *a = (uchar *)malloc(TEST_BUF_SIZE);
+	uchar *b = (uchar *)malloc(TEST_BUF_SIZE);
+
+	srand(TEST_SEED);
+	for(int i = 0; i < count; i++){
+		set.name = list[i]->name;
+		set.sum8 = list[i]->sum8;
+		set.is_blank = list[i]->is_blank;
+		set.find_diff = list[i]->find_diff;
+		CheckSet(&set, list[0], a, b);
+		printf("%-10s checked\n", set.name);
+	}
+
+	// What the flasher calls, whichever set XBIT_KERNELS or the CPU picked
+	set.name = "dispatched";
+	set.sum8 = sum8;
+	set.is_blank = is_blank;
+	set.find_diff = find_diff;
+	CheckSet(&set, list[0], a, b);
+	printf("%-10s checked (%s)\n", set.name, byte_kernels()->name);
+
+	free(a);
+	free(b);
+	printf("%s, %i failure(s)\n", failures ? "FAILED" : "OK", failures);
+	return failures ? 1 : 0;
+}
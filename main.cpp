@@ -2,912 +2,891 @@
  * X-Bit (Xbit) Modchip Flasher (XBIT v1.0)
  *********************************************************************************************************/
 
-#ifdef WIN32
-#include <windows.h>
-#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <cstring>
+#include <thread>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <time.h>
+#endif
 
-// IMPORTANT: Define single byte packing
-#pragma pack(1)
 #include "xbit.h"
-
-/////////////////// Macros
-#define min(x,y) (((x)<(y))?(x):(y))
-
-// For converting 8051 big endian to x86 little endian format   
-#define SWAP_UINT16(x) ((((x)&0xff00)>>8) | (((x)&0x00ff)<<8))   
-#define SWAP_UINT32(x) ((((x)&0xff000000)>>24) | (((x)&0x00ff0000)>>8) | (((x)&0x0000ff00)<<8) | (((x)&0x000000ff)<<24)) 
+#include "transport.h"
 
 /////////////////// Constants
-#define MAX_STR				255
-#define MAX_SECTOR_SIZE		0x8000 // half block
-
-#define INPUT_REPORT_SIZE	64
-
-#define ST_VENDOR_ID        0x0483   
-#define ST_PRODUCT_ID       0x0000
+#define MAX_DEVICES			16
 
-#define DEBUG
-
-////////////////// Debug helper
-void print_bytes(PREPORT_BUF input, int length)
+typedef struct
 {
-	int i;
-	printf("reportID: %i, cmd: %02X, buf: ", input->reportID, input->report.u.cmd);
-	for (i=0; i < length; i++)
-		printf("%02X ", input->report.u.buffer[i]);
-	printf("\n");
-}
+	const uchar *data;		// Flash contents, past the header of a chip image
+	int size;
+	void *map;
+	long map_size;
+} IMAGE;
 
-///////////////// Class
-XbitFlasher::XbitFlasher()
+bool CheckImageSize(long size)
 {
-	// Initialize the hidapi library
-	hid_init();
-	this->device_initialized = false;
+	if(size == 0){
+		log_printf("BIOS file is empty\n");
+		return false;
+	}
+	else if(size > (2 * 1024 * 1024)){
+		log_printf("BIOS size if bigger than 2MB\n");
+		return false;
+	}
+	else if(size % BLOCK_SIZE){
+		log_printf("BIOS does not align with Block size\n");
+		return false;
+	}
+	return true;
 }
 
-XbitFlasher::~XbitFlasher()
+// Maps the file read-only, the flasher sends it straight from the page cache
+bool MapFile(const char *filename, IMAGE *image)
 {
-	// Finalize the hidapi library
-	hid_exit();
-}
+	memset(image, 0, sizeof(IMAGE));
+#ifndef WIN32
+	struct stat st;
+	void *map;
+	int fd;
 
-bool XbitFlasher::OpenDevice()
-{
-	int res;
-	wchar_t wstr[MAX_STR];
-	// Open the device using the VID, PID,
-	// and optionally the Serial number.
-	this->handle = hid_open(ST_VENDOR_ID, ST_PRODUCT_ID, NULL);
-	if(!handle){
-		printf("ERROR: Failed to open hid device!\n");
+	fd = open(filename, O_RDONLY);
+	if(fd < 0){
+		log_printf("Failed to open BIOS binary!\n");
 		return false;
 	}
-
-	res = hid_get_manufacturer_string(handle, wstr, MAX_STR);
-	if(wcsncmp(wstr, DEVICE_MFG, wcslen(DEVICE_MFG))){
-		printf("ERROR: Invalid manufacturer string: %ls\n", wstr);
-		CloseDevice();
+	if(fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > (off_t)(sizeof(CHIP_HEADER) + TOTAL_BLOCKS * BLOCK_SIZE)){
+		log_printf("BIOS size %li is not a valid image size\n", (long)st.st_size);
+		close(fd);
 		return false;
 	}
-
-	// Product String: DK3200 Evaluation Board
-	res = hid_get_product_string(handle, wstr, MAX_STR);
-	if(wcsncmp(wstr, DEVICE_PRODUCT, wcslen(DEVICE_PRODUCT))){
-		printf("ERROR: Invalid product string: %ls", wstr);
-		CloseDevice();
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		log_printf("Failed to map BIOS binary!\n");
 		return false;
 	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	image->map = map;
+	image->map_size = st.st_size;
+#else
+	FILE *f = NULL;
+	uchar *data;
+	long size;
 
-	if(!GetStatus()){
-		printf("ERROR: Failed to initially get status from modchip. Please retry\n");
+	f = fopen(filename, "rb");
+	if(f == NULL){
+		log_printf("Failed to open BIOS binary!\n");
 		return false;
 	}
-	this->memory_layout_id = GetMemoryLayout();
-	this->device_initialized = true;
-	return true;
-}
-
-bool XbitFlasher::CloseDevice()
-{
-	Reset();
-	if(handle)
-		hid_close(handle);
-	this->device_initialized = false;
-	return true;
-}
-
-hid_device *XbitFlasher::GetHandle()
-{
-	return this->handle;
-}
-
-bool XbitFlasher::IsDeviceInitialized()
-{
-	return this->device_initialized;
-}
-
-bool XbitFlasher::IsValidStatus()
-{
-	return (this->statusBuf.reportID == 0 && this->statusBuf.report.u.status.cmd == CMD_GET_STATUS);
-}
-
-uchar XbitFlasher::GetCurrentCommand()
-{
-	return this->statusBuf.report.u.status.currentCmd;
-}
-
-uchar XbitFlasher::GetMemoryLayout()
-{
-	return this->statusBuf.report.u.status.page;
-}
-
-uchar XbitFlasher::GetVMState()
-{
-	return this->statusBuf.report.u.status.vm;
-}
-
-bool XbitFlasher::IsDeviceReady()
-{
-	return (GetCurrentCommand() == 0);
-}
-
-bool XbitFlasher::IsDeviceBusFree()
-{
-	return ((GetVMState() & STATUS_BUS_FREE) == STATUS_BUS_FREE);
-}
-
-bool XbitFlasher::IsDeviceBusAttached()
-{
-	return ((GetVMState() & STATUS_BUS_ATTACHED) == STATUS_BUS_ATTACHED);
-}
-
-bool XbitFlasher::IsDeviceWriteprotected()
-{
-	return ((GetVMState() & STATUS_WRITE_PROTECT) == STATUS_WRITE_PROTECT);
-}
-
-int XbitFlasher::InternalRead(PREPORT_BUF output)
-{
-	int res;
-	/* NOTE: Dont use hid_read */
-	res = hid_get_feature_report(this->handle, (unsigned char*)output, sizeof(REPORT_BUF));
-#ifdef DEBUG
-	if(res == sizeof(REPORT_BUF))
-		print_bytes(output, OUTPUT_REPORT_SIZE);
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	if(size <= 0 || size > (long)(sizeof(CHIP_HEADER) + TOTAL_BLOCKS * BLOCK_SIZE)){
+		log_printf("BIOS size %li is not a valid image size\n", size);
+		fclose(f);
+		return false;
+	}
+	data = (uchar *)malloc(size);
+	if(fread(data, size, 1, f) != 1){
+		log_printf("Failed to read BIOS binary!\n");
+		free(data);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	image->map = data;
+	image->map_size = size;
 #endif
-	return res;
+	image->data = (const uchar *)image->map;
+	image->size = image->map_size;
+	return true;
 }
 
-int XbitFlasher::InternalWrite(PREPORT_BUF input)
+void FreeFile(IMAGE *image)
 {
-	int res;
-	res = hid_write(this->handle, (unsigned char*)input, sizeof(REPORT_BUF));
-	usleep(8000);
-#ifdef DEBUG
-	if(res == sizeof(REPORT_BUF))
-		print_bytes(input, OUTPUT_REPORT_SIZE);
+	if(!image->map)
+		return;
+#ifndef WIN32
+	munmap(image->map, image->map_size);
+#else
+	free(image->map);
 #endif
-	return res;
+	image->map = NULL;
+	image->data = NULL;
 }
 
-bool XbitFlasher::GetStatus()
+// Bank image: raw flash contents
+bool LoadFile(const char *filename, IMAGE *image)
 {
-    REPORT_BUF reportBuf;   
-    memset(&reportBuf, 0, sizeof(REPORT_BUF));   
-   
-    // Send command
-
-    reportBuf.reportID     = 0;   
-    reportBuf.report.u.cmd = CMD_GET_STATUS; 
-
-	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
-		printf("Error sending CMD_STATUS command.\n");
+	if(!MapFile(filename, image))
 		return false;
-	}
-
-	memset(&statusBuf, 0x00, sizeof(REPORT_BUF));
-	if(InternalRead(&statusBuf) != sizeof(REPORT_BUF)){
-		printf("Error reading CMD_GET_STATUS reply.\n");
+	if(!CheckImageSize(image->size)){
+		FreeFile(image);
 		return false;
 	}
-
 	return true;
 }
 
-bool XbitFlasher::Reset()
+// Whole-chip image: CHIP_HEADER, then the complete flash
+bool LoadChipFile(const char *filename, IMAGE *image, int *layout)
 {
-   REPORT_BUF reportBuf;   
-   memset(&reportBuf, 0, sizeof(REPORT_BUF));   
-   
-   // Send command
+	const CHIP_HEADER *header;
 
-   reportBuf.reportID     = 0;   
-   reportBuf.report.u.cmd = CMD_RESET; 
-
-	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
-		printf("Error sending CMD_RESET command.\n");  
+	if(!MapFile(filename, image))
+		return false;
+	header = (const CHIP_HEADER *)image->map;
+	if(image->map_size != sizeof(CHIP_HEADER) + TOTAL_BLOCKS * BLOCK_SIZE
+		|| memcmp(header->magic, CHIP_IMAGE_MAGIC, sizeof(header->magic))
+		|| header->version != CHIP_IMAGE_VERSION || header->size != TOTAL_BLOCKS * BLOCK_SIZE){
+		log_printf("%s is not a whole-chip image\n", filename);
+		FreeFile(image);
 		return false;
 	}
-
-	return true;
-}
-
-bool XbitFlasher::SetVM(uchar vm)
-{
-	REPORT_BUF reportBuf;   
-	memset(&reportBuf, 0, sizeof(REPORT_BUF));   
-   
-    // Send command
-
-    reportBuf.reportID             = 0;   
-    reportBuf.report.u.setRegs.cmd = CMD_SET_VM;   
-    reportBuf.report.u.setRegs.vm  = vm;  
-
-	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
-		printf("Error sending CMD_SET_VM command.\n");  
+	if(header->layout < 1 || header->layout > BANK_LAYOUT_COUNT){
+		log_printf("%s has invalid layout %i\n", filename, header->layout);
+		FreeFile(image);
 		return false;
 	}
-
+	*layout = header->layout;
+	image->data += sizeof(CHIP_HEADER);
+	image->size -= sizeof(CHIP_HEADER);
 	return true;
 }
 
-bool XbitFlasher::GetBus()
+// <filename>.digests next to a dump or a flashed image, a failure only costs the sidecar
+void SaveDigests(const char *filename, const IMAGE_DIGESTS *digests)
 {
-	return this->SetVM(1);
-}
+	char sidecar[MAX_STR];
 
-bool XbitFlasher::ReleaseBus()
-{
-	return this->SetVM(0);
+	if(snprintf(sidecar, sizeof(sidecar), "%s" DIGEST_FILE_EXT, filename) >= (int)sizeof(sidecar)
+		|| !DigestsSave(digests, sidecar))
+		log_printf("Could not write digests of %s\n", filename);
 }
 
-bool XbitFlasher::SetPage(int layout_id)
+// Flashing the same image again leaves its sidecar alone
+void SaveImageDigests(const char *filename, int layout, int bank, const uchar *data, int size)
 {
-    REPORT_BUF reportBuf;   
-    memset(&reportBuf, 0, sizeof(REPORT_BUF));
-
-    // Send command
+	IMAGE_DIGESTS digests, existing;
+	char sidecar[MAX_STR];
 
-    reportBuf.reportID              = 0;   
-    reportBuf.report.u.setRegs.cmd  = CMD_SET_PAGE;   
-    reportBuf.report.u.setRegs.page = layout_id & 0xFF;
-
-	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
-		printf("Error sending CMD_SET_PAGE command.\n");
-		return false;
-	}
-
-	return true;
+	DigestsInit(&digests, layout, bank);
+	DigestsUpdate(&digests, data, size);
+	DigestsFinal(&digests);
+	if(snprintf(sidecar, sizeof(sidecar), "%s" DIGEST_FILE_EXT, filename) < (int)sizeof(sidecar)
+		&& DigestsLoad(&existing, sidecar) && existing.layout == layout && existing.bank == bank
+		&& existing.size == size && !memcmp(existing.image_sha, digests.image_sha, SHA256_SIZE))
+		return;
+	SaveDigests(filename, &digests);
 }
 
-bool XbitFlasher::ReadFlash(uchar flash, uchar sector, uint16 offset, uchar *buffer, uint16 nBytes)
+typedef struct
 {
-	time_t t1, t2;  
-    REPORT_BUF reportBuf;   
-    memset(&reportBuf, 0, sizeof(REPORT_BUF));   
-   
-    if (!nBytes)   
-    {   
-        printf("Invalid count of bytes to read.\n");   
-        return false;   
-    }   
-   
-   	// Original DK3200 way:
-    // Convert sector offset to xdata address
-    //uint16 address = OffsetToAddress(flash, sector, offset);
-    
-    // XBIT way:
-    // The "address"-field is relative to sector, e.g. it defines address INSIDE the sector
-    // The "flash" field sets the sector
-   
-    // Send command   
-   
-    reportBuf.reportID            = 0;   
-    reportBuf.report.u.cmd        = CMD_READ;   
-    //reportBuf.report.u.rw.flash   = flash;
-    //reportBuf.report.u.rw.address = SWAP_UINT16(address); 
-    reportBuf.report.u.rw.flash   = sector;
-    reportBuf.report.u.rw.address = SWAP_UINT16(offset);  
-    reportBuf.report.u.rw.nBytes  = SWAP_UINT16(nBytes);    
-   
-	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF))
-    {   
-        printf("ERROR: Error sending CMD_READ command.\n");    
-        return false;   
-    }   
-   
-    time(&t1);
-    // Read data   
-   
-    uint16 cbRemaining = nBytes;   
-    uint16 cbTemp = cbRemaining;   
-    while (cbRemaining)   
-    {   
-        if (InternalRead(&reportBuf) != sizeof(REPORT_BUF))   
-        {   
-            printf("ERROR: Error reading CMD_READ reply.\n");   
-            return false;   
-        }
-   
-        // Skip 0 command byte at start of report buffer   
-   
-        uint16 cbData = min(cbRemaining, CMD_SIZE - 1);   
-        memcpy(buffer, reportBuf.report.u.buffer + 1, cbData);   
-        buffer += cbData;   
-        cbRemaining -= cbData;   
-   
-        if ((cbTemp/100) != (cbRemaining/100))   
-        {   
-            printf("Reading flash: %d bytes remaining\n", (cbTemp/100)*100);
-            cbTemp = cbRemaining;   
-        }   
-    }
-   
-    time(&t2);
-    printf("Reading Flash is done.\n");
-    printf(" Time consumed %f seconds.\n", difftime(t1, t2));  
-    return true;   
-}
-
+	FILE *f;
+	IMAGE_DIGESTS digests;
+} SAVE_CONTEXT;
 
-bool XbitFlasher::WriteFlash(uchar flash, uchar sector, uint16 offset, uchar *buffer, uint16 nBytes)
+// Sink for ReadBank, the dump goes out sector by sector while it is read
+bool SaveSector(void *context, int offset, const uchar *data, int length)
 {
-    REPORT_BUF reportBuf;   
-    memset(&reportBuf, 0, sizeof(REPORT_BUF));   
-   
-    if (!nBytes)   
-    {   
-        printf("Invalid count of bytes to write.\n");   
-        return false;   
-    }   
-
-    // Calculate checksum   
-
-    uchar checkSum = 0;   
-    for (int i = 0; i < nBytes; i++)   
-    {   
-        checkSum += buffer[i];
-    }   
-   
-   	// Original DK3200 way:
-    // Convert sector offset to xdata address
-    //uint16 address = OffsetToAddress(flash, sector, offset);
-    
-    // XBIT way:
-    // The "address"-field is relative to sector, e.g. it defines address INSIDE the sector
-    // The "flash" field sets the sector
-
-    // Send command   
-   
-    reportBuf.reportID            = 0;   
-    reportBuf.report.u.cmd        = CMD_WRITE;   
-    //reportBuf.report.u.rw.flash   = flash;
-    //reportBuf.report.u.rw.address = SWAP_UINT16(address);
-    reportBuf.report.u.rw.flash   = sector;
-    reportBuf.report.u.rw.address = SWAP_UINT16(offset);
-    reportBuf.report.u.rw.nBytes  = SWAP_UINT16(nBytes);   
-   
-    if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF))
-    {   
-        printf("Error sending CMD_WRITE command.\n");     
-        return false;   
-    }
-   	usleep(2000);
-    // Write data   
-   
-    uint16 cbRemaining = nBytes;   
-    uint16 cbTemp = cbRemaining;   
-    while (cbRemaining)   
-    {   
-        uint16 cbData = min(cbRemaining, CMD_SIZE - 1);   
-   
-        reportBuf.reportID = 0;   
-        reportBuf.report.u.cmd = 0;   
-        memcpy(reportBuf.report.u.buffer + 1, buffer, cbData);   
-   
-        if (InternalWrite(&reportBuf) != sizeof(REPORT_BUF))
-        {   
-            printf("Error writing data.\n");     
-            return false;   
-        }
-   
-        buffer += cbData;   
-        cbRemaining -= cbData;   
-   
-        // Update display on every 100 byte boundary   
-   
-        if ((cbTemp/100) != (cbRemaining/100))   
-        {   
-            printf("Writing flash: %d bytes remaining\n", (cbTemp/100)*100);   
-            cbTemp = cbRemaining;   
-        }   
-    }   
-   
-    // Verify check sum   
-   
-    if (GetStatus())
-    {   
-        if (this->statusBuf.report.u.status.checkSum != checkSum)   
-        { 
-			printf("Write operation failed: the checksum calculated from\na readback does not match the checksum for the data written.\n");
-			// NOTE: Seems like XBIT does not report back with checksum?
-            //return false;   
-        }   
-    }   
-     
-    return true;
+	SAVE_CONTEXT *save = (SAVE_CONTEXT *)context;
+
+	DigestsUpdate(&save->digests, data, length);
+	return fwrite(data, length, 1, save->f) == 1;
 }
 
-bool XbitFlasher::EraseBlock(int flash, int sector)
+// Don't leave a truncated image behind that looks like a dump, /dev/null and the like stay
+void RemovePartialFile(const char *filename)
 {
-   REPORT_BUF reportBuf;   
-   memset(&reportBuf, 0, sizeof(REPORT_BUF));   
-   
-   // Original DK3200 way:
-   // Convert sector address 0 to xdata address   
-   //uint16 address = OffsetToAddress(flash, sector, 0);
-
-   // XBIT way:
-   // The address field is always 0
-   // Sector is defined by "flash"-byte   
-
-   // Send command   
-   
-   reportBuf.reportID               = 0;   
-   reportBuf.report.u.erase.cmd     = CMD_ERASE;
-   //reportBuf.report.u.erase.address = SWAP_UINT16(address);   
-   //reportBuf.report.u.erase.flash   = (uchar) flash;
-   reportBuf.report.u.erase.address = 0;
-   reportBuf.report.u.erase.flash   = (uchar) sector;
-
-	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
-		printf("Error sending CMD_ERASE command.\n");   
-		return false;
-	}
+#ifndef WIN32
+	struct stat st;
 
-	return true;
+	if(stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+#endif
+	remove(filename);
 }
 
-bool XbitFlasher::Format(int layout)
+// Bank 0 dumps the whole chip, behind a CHIP_HEADER recording the layout
+bool SaveFile(XbitFlasher *flasher, int bank, const char *filename, int *bytes_read)
 {
-	int res = 0;
-	if(layout < 1 || layout > BANK_LAYOUT_COUNT){
-		printf("Invalid layout %i, valid: %i-%i\n", layout, 1, BANK_LAYOUT_COUNT);
-		return false;
-	}
+	FILE *f = NULL;
+	CHIP_HEADER header;
+	SAVE_CONTEXT save;
+	bool res;
 
-	if(IsDeviceWriteprotected()){
-		printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+	// LoadChipFile would refuse the image later on, don't write one
+	if(!bank && (flasher->memory_layout_id < 1 || flasher->memory_layout_id > BANK_LAYOUT_COUNT)){
+		log_printf("Modchip reports invalid layout %i, format it before dumping the whole chip\n", flasher->memory_layout_id);
 		return false;
 	}
 
-	res = GetBus();
-	if(!res){
-		printf("Failed to get bus\n");
+	f = strcmp(filename, "-") ? fopen(filename, "wb") : stdout;
+	if(f == NULL){
+		log_printf("Failed to open BIOS binary!\n");
 		return false;
 	}
+	save.f = f;
+	DigestsInit(&save.digests, flasher->memory_layout_id, bank);
 
-	printf("Formatting...\n");
-	for (int i=0; i < TOTAL_BLOCKS; i++){
-		res = EraseBlock(0, i);
-		if(!res){
-			printf("Failed to erase block %i\n", i);
-			return false;
-		}
+	if(bank){
+		res = flasher->ReadBank(bank, SaveSector, &save, bytes_read);
 	}
-
-	res = SetPage(layout);
-	if(!res){
-		printf("Failed to set memory layout, id: %i\n", layout);
-		return false;
+	else {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CHIP_IMAGE_MAGIC, sizeof(header.magic));
+		header.version = CHIP_IMAGE_VERSION;
+		header.layout = flasher->memory_layout_id;
+		header.size = TOTAL_BLOCKS * BLOCK_SIZE;
+		res = fwrite(&header, sizeof(header), 1, f) == 1 && flasher->ReadChip(SaveSector, &save, bytes_read);
 	}
-
-	this->memory_layout_id = layout;
-	res = ReleaseBus();
+	if(f == stdout)
+		return fflush(f) == 0 && res;
+	res = fclose(f) == 0 && res;
 	if(!res){
-		printf("Failed to release bus\n");
+		RemovePartialFile(filename);
 		return false;
 	}
-
-	printf("Format finished!\n");
+	DigestsFinal(&save.digests);
+	SaveDigests(filename, &save.digests);
 	return true;
 }
 
-bool XbitFlasher::EraseBank(int bank)
-{
-	int res = 0;
-	int bank_size = GetSizeForBank(this->memory_layout_id, bank);
-	int current_block = GetStartblockForBank(this->memory_layout_id, bank);
-	int block_count = CalculateBlockIndexForOffset(bank_size);
-
-	if(IsDeviceWriteprotected()){
-		printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
-		return false;
-	}
-
-	res = GetBus();
-	if(!res){
-		printf("Failed to get bus\n");
-		return false;
-	}
-	printf("Erasing bank %i...\n", bank);
-	for (int i = current_block; i < (current_block + block_count); i++){
-		res = EraseBlock(0, i);
-		if(!res){
-			printf("Failed to erase block %i\n", i);
+// Applies the --options to a flasher, returns false on unknown ones
+bool ParseOptions(XbitFlasher *flasher, int argc, char *argv[])
+{
+	for(int i = 1; i < argc; i++){
+		if(strncmp(argv[i], "--", 2))
+			continue;
+		if(!strcmp(argv[i], "--diff"))
+			flasher->diff_mode = true;
+		else if(!strcmp(argv[i], "--blank-check"))
+			flasher->blank_check = true;
+		else if(!strcmp(argv[i], "--verify"))
+			flasher->verify_mode = true;
+		else if(!strcmp(argv[i], "--fail-fast"))
+			flasher->verify_fail_fast = true;
+		else if(!strncmp(argv[i], "--retries=", 10))
+			flasher->retry.max_attempts = atoi(argv[i] + 10);
+		else if(!strncmp(argv[i], "--transport=", 12)){
+			if(!flasher->SetTransport(Transport::ParseType(argv[i] + 12))){
+				printf("Transport %s is not available\n", argv[i] + 12);
+				return false;
+			}
+		}
+		else if(!strncmp(argv[i], "--trace=", 8))
+			flasher->trace_file = argv[i] + 8;
+		else if(!strcmp(argv[i], "--quiet"))
+			flasher->progress.enabled = false;
+		else if(!strcmp(argv[i], "--verbose"))
+			flasher->trace_verbose = true;
+		else if(!strcmp(argv[i], "--strict"))
+			flasher->cache.strict = true;
+		else if(!strcmp(argv[i], "--no-cache"))
+			flasher->cache.enabled = false;
+		else if(!strcmp(argv[i], "--no-profile"))
+			flasher->use_profile = false;
+		else if(!strcmp(argv[i], "--no-pipeline"))
+			flasher->use_pipeline = false;
+		else if(!strncmp(argv[i], "--queue-depth=", 14)){
+			flasher->queue_depth = atoi(argv[i] + 14);
+			if(flasher->queue_depth < 1 || flasher->queue_depth > QUEUE_DEPTH_MAX){
+				printf("Queue depth must be 1..%i\n", QUEUE_DEPTH_MAX);
+				return false;
+			}
+		}
+		else if(!strcmp(argv[i], "--all"))
+			continue; // Handled by main
+		else {
+			printf("Unknown option %s\n", argv[i]);
 			return false;
 		}
 	}
-
-	res = ReleaseBus();
-	if(!res){
-		printf("Failed to release bus\n");
+	// Without an async path the queued reports would just go out back to back, unpaced
+	if(flasher->queue_depth > 1 && !flasher->GetTransport()->CanQueue()){
+		printf("--queue-depth needs a transport that queues reports (libusb, mem), not %s\n", flasher->GetTransport()->GetName());
 		return false;
 	}
-
 	return true;
 }
 
-bool XbitFlasher::FlashBank(int bank, uchar *input_data, int data_length)
+///////////////// Manifest
+// One layout, then one line per bank:
+//   layout 1
+//   bank 1 evox.bin verify
+//   bank 2 xecuter.bin
+// Image paths are relative to the manifest, # starts a comment
+typedef struct
 {
-	int res = 0;
-	int bank_size = GetSizeForBank(this->memory_layout_id, bank);
-	int start_block = GetStartblockForBank(this->memory_layout_id, bank);
-	int block_count = CalculateBlockIndexForOffset(bank_size);
+	int bank;
+	char filename[MAX_STR];
+	bool verify;
+	IMAGE image;
+} MANIFEST_BANK;
 
-	if(bank_size != data_length){
-		printf("BIOS size %i does not match bank size %i\n", data_length, bank_size);
-		return false;
-	}
-
-	if(IsDeviceWriteprotected()){
-		printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
-		return false;
-	}
-
-	res = EraseBank(bank);
-	if(!res){
-		printf("Failed to erase bank\n");
-		return false;
-	}
-
-	sleep(2);
-
-	res = GetBus();
-	if(!res){
-		printf("Failed to get bus\n");
-		return false;
-	}
-
-	int offset = 0;
-	for(int block = 0; block < block_count; ++block) {
-		for(int sector = 0; sector < (BLOCK_SIZE / MAX_SECTOR_SIZE); sector++) {
-			offset = (block * BLOCK_SIZE) + (sector * MAX_SECTOR_SIZE);
-			printf("Writing block: %i, sector %i @ 0x%08X\n", start_block + block, sector, offset);
-			res = WriteFlash(0, start_block + block, sector * MAX_SECTOR_SIZE, &input_data[offset], MAX_SECTOR_SIZE);
-			while(!res){
-				// Awesome hack: repeat until success....
-				res = WriteFlash(0, start_block + block, sector * MAX_SECTOR_SIZE, &input_data[offset], MAX_SECTOR_SIZE);
-				if(res)
-					printf("Successs...\n");
-			}
-		}
-	}
+typedef struct
+{
+	int layout;
+	int count;
+	MANIFEST_BANK banks[BANKS_MAX];	// Sorted by bank, so erases and writes go up the flash in order
+} MANIFEST;
 
-	res = ReleaseBus();
-	if(!res){
-		printf("Failed to release bus\n");
-		return false;
-	}
-	return true;
+void FreeManifest(MANIFEST *manifest)
+{
+	for(int i = 0; i < manifest->count; i++)
+		FreeFile(&manifest->banks[i].image);
+	manifest->count = 0;
 }
 
-bool XbitFlasher::ReadBank(int bank, uchar *output_data, int *num_bytes_read)
+bool LoadManifest(const char *filename, MANIFEST *manifest)
 {
-	int res;
-	int bank_size = GetSizeForBank(this->memory_layout_id, bank);
-	int start_block = GetStartblockForBank(this->memory_layout_id, bank);
-	int block_count = CalculateBlockIndexForOffset(bank_size);
+	FILE *f = NULL;
+	char line[512], word[16], image[MAX_STR], option[16];
+	const char *slash;
+	MANIFEST_BANK *entry, tmp;
+	int bank, fields, length, line_no = 0;
 
-	if(IsDeviceWriteprotected()){
-		printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+	memset(manifest, 0, sizeof(MANIFEST));
+	f = fopen(filename, "r");
+	if(f == NULL){
+		log_printf("Failed to open manifest %s\n", filename);
 		return false;
 	}
 
-	res = GetBus();
-	if(!res){
-		printf("Failed to get bus\n");
-		return false;
-	}
+	while(fgets(line, sizeof(line), f)){
+		line_no++;
+		if(strchr(line, '#'))
+			*strchr(line, '#') = 0;
+		fields = sscanf(line, "%15s %i %254s %15s", word, &bank, image, option);
+		if(fields <= 0)
+			continue;
 
-	int offset = 0;
-	*num_bytes_read = 0;
-	for(int block = 0; block < block_count; ++block) {
-		printf("Reading block %i\n", start_block + block);
-		for(int sector = 0; sector < (BLOCK_SIZE / MAX_SECTOR_SIZE); sector++) {
-			offset = (block * BLOCK_SIZE) + (sector * MAX_SECTOR_SIZE);
-			printf("Reading sector %i @ %08X\n", sector, offset);
-			res = ReadFlash(0, start_block + block, sector * MAX_SECTOR_SIZE, &output_data[offset], MAX_SECTOR_SIZE);
-			if(!res){
-				printf("Failed to read data!\n");
-				return false;
+		if(!strcmp(word, "layout") && fields == 2){
+			if(bank < 1 || bank > BANK_LAYOUT_COUNT || manifest->layout){
+				log_printf("%s:%i: invalid or repeated layout\n", filename, line_no);
+				goto error;
+			}
+			manifest->layout = bank;
+		}
+		else if(!strcmp(word, "bank") && (fields == 3 || (fields == 4 && !strcmp(option, "verify")))){
+			if(!manifest->layout || !GetBankSchedule(manifest->layout, bank)){
+				log_printf("%s:%i: bank %i does not exist in layout %i\n", filename, line_no, bank, manifest->layout);
+				goto error;
+			}
+			for(int i = 0; i < manifest->count; i++){
+				if(manifest->banks[i].bank == bank){
+					log_printf("%s:%i: bank %i listed twice\n", filename, line_no, bank);
+					goto error;
+				}
+			}
+
+			entry = &manifest->banks[manifest->count];
+			entry->bank = bank;
+			entry->verify = (fields == 4);
+			slash = strrchr(filename, '/');
+			if(image[0] != '/' && slash)
+				length = snprintf(entry->filename, MAX_STR, "%.*s/%s", (int)(slash - filename), filename, image);
+			else
+				length = snprintf(entry->filename, MAX_STR, "%s", image);
+			if(length >= MAX_STR){
+				log_printf("%s:%i: image path too long\n", filename, line_no);
+				goto error;
+			}
+			if(!LoadFile(entry->filename, &entry->image))
+				goto error;
+			manifest->count++;
+			if(entry->image.size != GetBankSchedule(manifest->layout, bank)->size){
+				log_printf("%s:%i: %s does not fit bank %i (%i KB)\n", filename, line_no, entry->filename, bank,
+					GetBankSchedule(manifest->layout, bank)->size / 1024);
+				goto error;
 			}
-			*num_bytes_read += MAX_SECTOR_SIZE;
+		}
+		else {
+			log_printf("%s:%i: cannot parse: %s", filename, line_no, line);
+			goto error;
 		}
 	}
+	fclose(f);
 
-	res = ReleaseBus();
-	if(!res){
-		printf("Failed to release bus\n");
+	if(!manifest->count){
+		log_printf("Manifest %s lists no banks\n", filename);
 		return false;
 	}
+	// Insertion sort by bank, there are BANKS_MAX entries at most
+	for(int i = 1; i < manifest->count; i++){
+		for(int j = i; j > 0 && manifest->banks[j - 1].bank > manifest->banks[j].bank; j--){
+			tmp = manifest->banks[j];
+			manifest->banks[j] = manifest->banks[j - 1];
+			manifest->banks[j - 1] = tmp;
+		}
+	}
 	return true;
+
+error:
+	fclose(f);
+	FreeManifest(manifest);
+	return false;
+}
+
+typedef struct
+{
+	char name[64];
+	bool ok;
+	bool skipped;
+	unsigned long long us;
+} STAGE;
+
+void PrintManifestSummary(const STAGE *stages, int count, int res)
+{
+	unsigned long long total = 0;
+
+	log_printf("Manifest summary:\n");
+	for(int i = 0; i < count; i++){
+		total += stages[i].us;
+		log_printf("  %-20s %8.1f s  %s\n", stages[i].name, stages[i].us / 1000000.0,
+			stages[i].skipped ? "skipped" : stages[i].ok ? "OK" : "FAILED");
+	}
+	log_printf("  %-20s %8.1f s  %s\n", "total", total / 1000000.0, res ? "FAILED" : "OK");
+}
+
+// Format if needed, write every bank, then verify, all while holding the bus once
+int RunManifest(XbitFlasher *flasher, MANIFEST *manifest)
+{
+	STAGE stages[1 + 2 * BANKS_MAX];
+	STAGE *stage;
+	unsigned long long start;
+	int count = 0, verifies, res = 0;
+	bool failed = false;
+	MANIFEST_BANK *entry;
+
+	memset(stages, 0, sizeof(stages));
+
+	if(!flasher->BeginSession()){
+		log_printf("Failed to get bus\n");
+		return 6;
+	}
+
+	stage = &stages[count++];
+	snprintf(stage->name, sizeof(stage->name), "format layout %i", manifest->layout);
+	start = get_time_us();
+	if(flasher->memory_layout_id == manifest->layout){
+		log_printf("Chip already uses layout %i, no format needed\n", manifest->layout);
+		stage->skipped = true;
+		stage->ok = true;
+	}
+	else {
+		log_printf("Formatting chip for layout: %i\n", manifest->layout);
+		stage->ok = flasher->Format(manifest->layout);
+	}
+	stage->us = get_time_us() - start;
+	// Nothing written yet, the bus is left as Format left it, like after a failed (f)ormat
+	if(!stage->ok){
+		PrintManifestSummary(stages, count, 6);
+		return 6;
+	}
+
+	flasher->progress.BeginJob(manifest->count);
+	for(int i = 0; i < manifest->count && !res; i++){
+		entry = &manifest->banks[i];
+		stage = &stages[count++];
+		snprintf(stage->name, sizeof(stage->name), "write bank %i", entry->bank);
+		log_printf("Writing %s to bank %i\n", entry->filename, entry->bank);
+		start = get_time_us();
+		stage->ok = flasher->FlashBank(entry->bank, entry->image.data, entry->image.size);
+		stage->us = get_time_us() - start;
+		flasher->progress.EndBank();
+		if(!stage->ok)
+			res = 6;
+	}
+
+	// Verify the lot once everything is written, a failed bank doesn't stop the others
+	verifies = 0;
+	for(int i = 0; i < manifest->count; i++)
+		verifies += manifest->banks[i].verify;
+	flasher->progress.BeginJob(verifies);
+	for(int i = 0; i < manifest->count && !res; i++){
+		entry = &manifest->banks[i];
+		if(!entry->verify)
+			continue;
+		stage = &stages[count++];
+		snprintf(stage->name, sizeof(stage->name), "verify bank %i", entry->bank);
+		log_printf("Verifying bank %i with %s\n", entry->bank, entry->filename);
+		start = get_time_us();
+		stage->ok = flasher->VerifyBank(entry->bank, entry->image.data, entry->image.size);
+		stage->us = get_time_us() - start;
+		flasher->progress.EndBank();
+		if(!stage->ok)
+			failed = true;
+	}
+	if(failed)
+		res = 6;
+	if(!flasher->EndSession()){
+		log_printf("Failed to release bus\n");
+		res = 6;
+	}
+
+	PrintManifestSummary(stages, count, res);
+	return res;
 }
 
-bool XbitFlasher::VerifyBank(int bank, uchar *input_data, int data_length)
+typedef struct
 {
-	int res;
-	uchar buf[2 * 1024 * 1024];
-	int bank_size = GetSizeForBank(this->memory_layout_id, bank);
-	int bytes_read;
-
-	if(bank_size != data_length){
-		printf("Passed data length does not match bank size!\n");
-		return false;
-	}
-
-	res = ReadBank(bank, buf, &bytes_read);
-	if(!res){
-		printf("Failed to read bank for verification!\n");
-		return false;
-	}
+	char mode;
+	int layout;				// For (p)rogram taken from the image
+	int bank;
+	const char *filename;	// "-" dumps to stdout
+	const uchar *image;		// Image to write/verify/program
+	int size;
+	MANIFEST *manifest;		// (m)anifest
+	const IMAGE_DIGESTS *digests;	// (v)erify against a digest file instead of an image
+} JOB;
 
-	if(bytes_read != bank_size){
-		printf("Did not read enough data from bank for verification\n");
-		return false;
-	}
+// Runs one job on an opened device, returns the exit code
+int RunJob(XbitFlasher *flasher, JOB *job)
+{
+	int res, bytes_read = 0;
 
-	if(memcmp(buf, input_data, data_length)){
-		printf("Verificaton failed: Data mismatch!\n");
-		return false;
+	if((job->mode == 'r' || job->mode == 'w' || job->mode == 'v') && flasher->memory_layout_id != job->layout){
+		log_printf("Cannot execute read/write/verify action -> Supplied layout does not match with modchip layout!\n");
+		log_printf("Either it\'s an error or you did not format the chip initially with the correct layout\n");
+		log_printf("If error: Replug USB and run this tool again!\n");
+		return 5;
 	}
-	printf("Success! Data matches!\n");
-	return true;
-}
 
-uchar XbitFlasher::CalculateBlockIndexForOffset(int offset)
-{
-	if(offset == 0){
-		return 0;
-	}
-	else if(offset % BLOCK_SIZE){
-		printf("Error: Passed offset does not align with block size!!!\n");
-		return -1;
+	// Do stuff
+	switch(job->mode){
+		case 'r': // READ BANK
+			log_printf("Reading bank %i to %s\n", job->bank, job->filename);
+			res = SaveFile(flasher, job->bank, job->filename, &bytes_read);
+			if(!res){
+				log_printf("Reading flash to %s failed!\n", job->filename);
+				return 6;
+			}
+			log_printf("Read %i bytes..\n", bytes_read);
+			break;
+		case 'w': // WRITE BANK
+			log_printf("Writing %s to bank %i\n", job->filename, job->bank);
+			res = flasher->FlashBank(job->bank, job->image, job->size);
+			if(!res){
+				log_printf("Writing flash failed!\n");
+				return 6;
+			}
+			break;
+		case 'v': // VERIFY BANK
+			log_printf("Verifying bank %i with %s\n", job->bank, job->filename);
+			if(job->digests)
+				res = flasher->VerifyBankDigests(job->bank, job->digests);
+			else
+				res = flasher->VerifyBank(job->bank, job->image, job->size);
+			if(!res){
+				log_printf("Verification failed!\n");
+				return 6;
+			}
+			break;
+		case 'd': // DUMP CHIP
+			log_printf("Dumping whole chip (layout %i) to %s\n", flasher->memory_layout_id, job->filename);
+			res = SaveFile(flasher, 0, job->filename, &bytes_read);
+			if(!res){
+				log_printf("Dumping chip to %s failed!\n", job->filename);
+				return 6;
+			}
+			log_printf("Read %i bytes..\n", bytes_read);
+			break;
+		case 'p': // PROGRAM CHIP
+			log_printf("Programming whole chip from %s, layout %i\n", job->filename, job->layout);
+			res = flasher->ProgramChip(job->layout, job->image);
+			if(!res){
+				log_printf("Programming chip failed!\n");
+				return 6;
+			}
+			break;
+		case 'm': // MANIFEST
+			log_printf("Running manifest %s\n", job->filename);
+			res = RunManifest(flasher, job->manifest);
+			if(res)
+				return res;
+			break;
+		case 'f': // FORMAT CHIP
+			log_printf("Formatting chip for layout: %i\n", job->layout);
+			res = flasher->Format(job->layout);
+			if(!res){
+				log_printf("Formatting chip failed!\n");
+				return 6;
+			}
+			break;
+		case 'c': // CALIBRATE
+			log_printf("Calibrating transfer modes on %s\n", flasher->GetTransport()->GetName());
+			res = flasher->Calibrate();
+			if(!res){
+				log_printf("Calibration failed!\n");
+				return 6;
+			}
+			break;
 	}
-	return offset / BLOCK_SIZE;
+	return 0;
 }
 
-int XbitFlasher::GetStartblockForBank(int layout, int bank)
+// Sidecars of the images a job put on the chip, only once they are there
+void SaveJobDigests(const JOB *job)
 {
-	int offset = 0;
-	for(int i=1; i < bank; i++){
-		offset += GetSizeForBank(layout, i);
+	switch(job->mode){
+		case 'w':
+			SaveImageDigests(job->filename, job->layout, job->bank, job->image, job->size);
+			break;
+		case 'p':
+			SaveImageDigests(job->filename, job->layout, 0, job->image, job->size);
+			break;
+		case 'm':
+			for(int i = 0; i < job->manifest->count; i++)
+				SaveImageDigests(job->manifest->banks[i].filename, job->manifest->layout, job->manifest->banks[i].bank,
+					job->manifest->banks[i].image.data, job->manifest->banks[i].image.size);
+			break;
 	}
-	return CalculateBlockIndexForOffset(offset);
 }
 
-int XbitFlasher::GetSizeForBank(int layout, int bank)
-{
-	return bank_layout[layout-1][bank-1] * 1024;
-}
-
-void XbitFlasher::PrintMemoryBankLayout()
-{
-	int size;
-	printf("Memory Bank Configurations:\n");
-	for(int i=1; i <= BANK_LAYOUT_COUNT; i++){
-		printf("Layout %i: ", i);
-		for(int j=1; j <= BANKS_MAX; j++){
-			size = GetSizeForBank(i, j);
-			if (!size)
-				continue;
-			printf("Bios#%i [%ibytes] ", j, size / 1024);
+// Keeps the protocol trace when asked for, or when the job failed
+void SaveTrace(XbitFlasher *flasher, int result, const char *filename)
+{
+	if(!result && !flasher->trace_file)
+		return;
+	if(flasher->trace.Save(filename))
+		log_printf("Protocol trace of the last %i reports saved to %s\n", flasher->trace.GetCount(), filename);
+	else
+		log_printf("Failed to save protocol trace to %s\n", filename);
+}
+
+typedef struct
+{
+	XbitFlasher *flasher;
+	char path[MAX_STR];
+	char prefix[32];
+	char filename[MAX_STR];
+	char trace_file[MAX_STR];
+	JOB job;
+	int result;
+} FLEET_DEVICE;
+
+void RunFleetDevice(FLEET_DEVICE *dev)
+{
+	log_set_prefix(dev->prefix);
+	if(!dev->flasher->OpenDevice(dev->path)){
+		log_printf("Failed to open HID USB connection to X-Bit\n");
+		dev->result = 3;
+		return;
+	}
+	dev->result = RunJob(dev->flasher, &dev->job);
+	dev->flasher->RecordJob(!dev->result);
+	SaveTrace(dev->flasher, dev->result, dev->trace_file);
+	dev->flasher->CloseDevice();
+	log_printf("%s\n", dev->result ? "FAILED" : "Done");
+}
+
+// Runs the same job on every attached X-BIT in parallel, returns the worst exit code
+int RunFleet(XbitFlasher *flasher, int argc, char *argv[], JOB *job)
+{
+	char paths[MAX_DEVICES][MAX_STR];
+	FLEET_DEVICE *devs;
+	std::thread *threads;
+	int count, res = 0;
+
+	count = flasher->EnumerateDevices(paths, MAX_DEVICES);
+	if(!count){
+		printf("No X-Bit found\n");
+		return 3;
+	}
+	printf("Found %i X-Bit(s)\n", count);
+
+	devs = new FLEET_DEVICE[count];
+	threads = new std::thread[count];
+	for(int i = 0; i < count; i++){
+		devs[i].flasher = new XbitFlasher();
+		ParseOptions(devs[i].flasher, argc, argv);
+		devs[i].flasher->progress.redraw = false;	// Lines, the devices would fight over one status line
+		snprintf(devs[i].path, MAX_STR, "%s", paths[i]);
+		snprintf(devs[i].prefix, sizeof(devs[i].prefix), "[dev %i] ", i);
+		snprintf(devs[i].trace_file, MAX_STR, "%s.%i", flasher->trace_file ? flasher->trace_file : TRACE_FILE, i);
+		devs[i].job = *job;
+		devs[i].result = 0;
+		if(job->mode == 'r' || job->mode == 'd'){
+			// Every chip gets its own dump and buffer
+			snprintf(devs[i].filename, MAX_STR, "%s.%i", job->filename, i);
+			devs[i].job.filename = devs[i].filename;
 		}
-		printf("\n");
-	}	
-}
+		threads[i] = std::thread(RunFleetDevice, &devs[i]);
+	}
 
-void XbitFlasher::PrintBankSelection()
-{
-	int mask;
-	printf("DIP switch positions:\n");
-	printf("          1    2    3\n");
-	for(int i=0; i < BANKS_MAX; i++){
-		mask = bios_select_switches[i];
-		printf("Bios %i: %s - %s - %s\n", i + 1,
-			mask & 1 ? "ON " : "OFF",
-			mask & 2 ? "ON " : "OFF",
-			mask & 4 ? "ON " : "OFF");
+	printf("Summary:\n");
+	for(int i = 0; i < count; i++){
+		threads[i].join();
+		printf("[dev %i] %s: %s (%i)\n", i, devs[i].path, devs[i].result ? "FAILED" : "OK", devs[i].result);
+		if(devs[i].result > res)
+			res = devs[i].result;
+		delete devs[i].flasher;
 	}
+	delete[] threads;
+	delete[] devs;
+	return res;
 }
 
-void XbitFlasher::PrintUsage(const char* argv0)
+int main(int argc, char* argv[])
 {
-	printf("X-Bit (Xbit) Modchip Flasher (XBIT v1.0)\n");
-	printf("Usage: %s [mode] [layout] [bank] [filename]\n", argv0);
-	printf("  e.g. %s w 5 3 bios.bin\n", argv0);
-	printf("Modes:\n");
-	printf("(r)ead, (w)rite, (v)erify, (f)ormat\n");
-	printf("NOTE: To format the chip, only layout param is required\n");
-	printf("X-Bit Properties:\n\n");
-	PrintMemoryBankLayout();
-	PrintBankSelection();
-}
+	int res, layout=0, bank=0, argn=0;
+	bool fleet = false;
+	char *endPtr, *args[5];
+	IMAGE image;
+	MANIFEST manifest;
+	IMAGE_DIGESTS digests;
+	JOB job;
 
-bool LoadFile(const char *filename, uchar *data, int *size)
-{
-	FILE *f = NULL;
+	XbitFlasher flasher;
 
-	f = fopen(filename, "rb");
-	if(f == NULL){
-		printf("Failed to open BIOS binary!\n");
-		return false;
-	}
+	memset(&image, 0, sizeof(image));
+	memset(&manifest, 0, sizeof(manifest));
 
-	fseek(f, 0, SEEK_END);
-	*size = ftell(f);
-	rewind(f);
+	////////// Parse Cmdline
 
-	if(*size > (2 * 1024 * 1024)){
-		printf("BIOS size if bigger than 2MB\n");
-		return false;
+	// Options can go anywhere, collect the positional params around them
+	if(!ParseOptions(&flasher, argc, argv)){
+		flasher.PrintUsage(argv[0]);
+		res = 1;
+		goto exit_e0;
 	}
-	else if(*size % BLOCK_SIZE){
-		printf("BIOS does not align with Block size\n");
-		return false;
+	for(int i = 0; i < argc; i++){
+		if(!strcmp(argv[i], "--all"))
+			fleet = true;
+		else if(strncmp(argv[i], "--", 2) && argn < 5)
+			args[argn++] = argv[i];
 	}
 
-	fread(data, *size, 1, f);
-	fclose(f);
-	return true;
-}
-
-bool SaveFile(const char *filename, uchar *data, int size)
-{
-	int written = 0;
-	FILE *f = NULL;
+	memset(&job, 0, sizeof(job));
+	if(argn > 1)
+		job.mode = args[1][0];
 
-	f = fopen(filename, "wb");
-	if(f == NULL){
-		printf("Failed to open BIOS binary!\n");
-		return false;
+	// For format switch (f) only the layout parameter is needed, whole-chip (d)ump/(p)rogram only take the file,
+	// (c)alibrate takes nothing
+	if(argn < 2 || (argn < 3 && job.mode != 'c') || (argn < 5 && !strchr("fdpmc", job.mode))){
+		flasher.PrintUsage(argv[0]);
+		res = 1;
+		goto exit_e0;
 	}
 
-	if(size > (2 * 1024 * 1024)){
-		printf("BIOS size if bigger than 2MB\n");
-		return false;
-	}
-	else if(size % BLOCK_SIZE){
-		printf("BIOS does not align with Block size\n");
-		return false;
+	if(!job.mode || !strchr("rwvfdpmc", job.mode)){
+		printf("Invalid option chose!\n");
+		flasher.PrintUsage(argv[0]);
+		res = 4;
+		goto exit_e0;
 	}
 
-	written = fwrite(data, size, 1, f);
-	fclose(f);
-	return (written == 1);
-}
-
-int main(int argc, char* argv[])
-{
-	char mode;
-	int res, size=0, layout=0, bank=0, bytes_read=0;
-	char *endPtr, *filename;
-	uchar bios_buf[2 * 1024 * 1024]; // 2MB
-
-	XbitFlasher flasher = XbitFlasher();
-
-	////////// Parse Cmdline
+	if(job.mode == 'd' || job.mode == 'p' || job.mode == 'm')
+		job.filename = args[2];
+	else if(job.mode != 'f' && job.mode != 'c')
+		job.filename = args[4];
 
-	if(argc > 1)
-		mode = argv[1][0];
+	// A dump to stdout keeps stdout clean, the log goes to stderr
+	if((job.mode == 'r' || job.mode == 'd') && !strcmp(job.filename, "-")){
+		if(fleet){
+			printf("Cannot dump several X-Bits to stdout\n");
+			res = 2;
+			goto exit_e0;
+		}
+		log_set_output(stderr);
+	}
 
-	// For format switch (f) only the layout parameter is needed
-	if((argc < 5 && mode != 'f') || (mode == 'f' && argc < 3)){ // argc < 3
-		flasher.PrintUsage(argv[0]);
-		res = 1;
-		goto exit_e0;
+	if(job.mode == 'd' || job.mode == 'p' || job.mode == 'm'){
+		log_printf("%s file: %s\n", job.mode == 'm' ? "Manifest" : "Image", job.filename);
 	}
-	
-	layout = strtol(argv[2], &endPtr, 10);
-	if (!*argv[2] || *endPtr || layout < 1 || layout > BANK_LAYOUT_COUNT){
-		printf("Invalid layout parameter supplied. Valid: %i-%i\n", 1, BANK_LAYOUT_COUNT);
-		res = 2;
-		goto exit_e0;
+	else if(job.mode != 'c'){
+		layout = strtol(args[2], &endPtr, 10);
+		if (!*args[2] || *endPtr || layout < 1 || layout > BANK_LAYOUT_COUNT){
+			printf("Invalid layout parameter supplied. Valid: %i-%i\n", 1, BANK_LAYOUT_COUNT);
+			res = 2;
+			goto exit_e0;
+		}
+		log_printf("Chosen Layout: %i\n", layout);
+		job.layout = layout;
 	}
-	printf("Chosen Layout: %i\n", layout);
 
-	if(mode != 'f') {
-		bank = strtol(argv[3], &endPtr, 10);
-		if (!*argv[3] || *endPtr || bank < 1 || bank > BANKS_MAX){
+	if(strchr("rwv", job.mode)) {
+		bank = strtol(args[3], &endPtr, 10);
+		if (!*args[3] || *endPtr || bank < 1 || bank > BANKS_MAX){
 			printf("Invalid bank parameter supplied. Valid: %i-%i\n", 1, BANKS_MAX);
 			res = 2;
 			goto exit_e0;
 		}
-		printf("Chose BIOS Bank: %i\n", bank);
-		filename = argv[4];
-		printf("BIOS file: %s\n", filename);
+		if(!GetBankSchedule(layout, bank)){
+			printf("Layout %i has no bank %i\n", layout, bank);
+			res = 2;
+			goto exit_e0;
+		}
+		log_printf("Chose BIOS Bank: %i\n", bank);
+		job.bank = bank;
+		log_printf("BIOS file: %s\n", job.filename);
 	}
 
+	if(job.mode == 'v' && IsDigestFile(job.filename)){
+		if(!DigestsLoad(&digests, job.filename)){
+			log_printf("Loading digests %s failed!\n", job.filename);
+			res = 6;
+			goto exit_e0;
+		}
+		job.digests = &digests;
+	}
+	else if(job.mode == 'w' || job.mode == 'v'){
+		res = LoadFile(job.filename, &image);
+		job.image = image.data;
+		job.size = image.size;
+		if(!res){
+			log_printf("Loading file %s failed!\n", job.filename);
+			res = 6;
+			goto exit_e0;
+		}
+	}
+	else if(job.mode == 'm'){
+		if(!LoadManifest(job.filename, &manifest)){
+			log_printf("Loading manifest %s failed!\n", job.filename);
+			res = 6;
+			goto exit_e0;
+		}
+		job.manifest = &manifest;
+	}
+	else if(job.mode == 'p'){
+		res = LoadChipFile(job.filename, &image, &job.layout);
+		job.image = image.data;
+		job.size = image.size;
+		if(!res){
+			log_printf("Loading file %s failed!\n", job.filename);
+			res = 6;
+			goto exit_e0;
+		}
+	}
+
+	if(fleet){
+		res = RunFleet(&flasher, argc, argv, &job);
+		if(!res)
+			SaveJobDigests(&job);
+		goto exit_e0;
+	}
 
 	// First interaction with the modchip
-	res = flasher.OpenDevice();
+	res = flasher.OpenDevice(NULL);
 	if(!res){
-		printf("Failed to open HID USB connection to X-Bit\n");
+		log_printf("Failed to open HID USB connection to X-Bit\n");
 		res = 3;
 		goto exit_e0;
 	}
 
-	if((mode == 'r' || mode == 'w' || mode == 'v') && flasher.memory_layout_id != layout){
-		printf("Cannot execute read/write/verify action -> Supplied layout does not match with modchip layout!\n");
-		printf("Either it\'s an error or you did not format the chip initially with the correct layout\n");
-		printf("If error: Replug USB and run this tool again!\n");
-		res = 5;
-		goto exit_e1;
-	}
-
-
-	// Do stuff
-	switch(mode){
-		case 'r': // READ BANK
-			printf("Reading bank %i to %s\n", bank, filename);
-			res = flasher.ReadBank(bank, bios_buf, &bytes_read);
-			if(!res){
-				printf("Reading flash failed!\n");
-				res = 6;
-				goto exit_e1;
-			}
-			printf("Read %i bytes..\n", bytes_read);
-			res = SaveFile(filename, bios_buf, bytes_read);
-			if(!res){
-				printf("Saving file %s failed!\n", filename);
-				res = 6;
-				goto exit_e1;
-			}
-			break;
-		case 'w': // WRITE BANK
-			printf("Writing %s to bank %i\n", filename, bank);
-			res = LoadFile(filename, bios_buf, &size);
-			if(!res){
-				printf("Loading file %s failed!\n", filename);
-				res = 6;
-				goto exit_e1;
-			}
-			res = flasher.FlashBank(bank, bios_buf, size);
-			if(!res){
-				printf("Writing flash failed!\n");
-				res = 6;
-				goto exit_e1;
-			}
-			break;
-		case 'v': // VERIFY BANK
-			printf("Verifying bank %i with %s\n", bank, filename);
-			res = LoadFile(filename, bios_buf, &size);
-			if(!res){
-				printf("Loading file %s failed!\n", filename);
-				res = 6;
-				goto exit_e1;
-			}
-			res = flasher.VerifyBank(bank, bios_buf, size);
-			if(!res){
-				printf("Verification failed!\n");
-				res = 6;
-				goto exit_e1;
-			}
-			break;
-		case 'f': // FORMAT CHIP
-			printf("Formatting chip for layout: %i\n", layout);
-			res = flasher.Format(layout);
-			if(!res){
-				printf("Formatting chip failed!\n");
-				res = 6;
-				goto exit_e1;
-			}
-			break;
-		default:
-			printf("Invalid option chose!\n");
-			flasher.PrintUsage(argv[0]);
-			res = 4;
-			goto exit_e1;
-	}
+	res = RunJob(&flasher, &job);
+	flasher.RecordJob(!res);
+	if(!res)
+		SaveJobDigests(&job);
+	SaveTrace(&flasher, res, flasher.trace_file ? flasher.trace_file : TRACE_FILE);
 
-exit_e1:
 	flasher.CloseDevice();
 exit_e0:
+	FreeFile(&image);
+	FreeManifest(&manifest);
 	return res;
 }
@@ -0,0 +1,354 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Write pipeline
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <unistd.h>
+#include <thread>
+
+#include "xbit.h"
+
+#define min(x,y) (((x)<(y))?(x):(y))
+
+// What the preparation thread works from, nothing above checks changes while it runs
+typedef struct
+{
+	FrameRing *ring;
+	ProgressMeter *progress;
+	const uchar *input_data;
+	const bool *changed;
+	const bool *erased;
+	int start_block;
+	int block_count;
+	int chunk_size;
+	char log_prefix[32];
+
+	// Written blocks on their way back, a slot is the writer's again once it collected the result
+	BLOCK_CHECK checks[PIPELINE_CHECKS];
+	std::atomic<unsigned> checks_queued;	// Only the writer moves it
+	std::atomic<unsigned> checks_done;		// Only the preparation thread moves it
+	uchar digests[TOTAL_BLOCKS][SHA256_SIZE];	// Of the blocks that matched
+} PIPELINE;
+
+///////////////// Ring
+FrameRing::FrameRing()
+{
+	this->slots = new WRITE_FRAMES[PIPELINE_SLOTS];
+	this->head = 0;
+	this->tail = 0;
+	this->finished = false;
+	this->stopped = false;
+}
+
+FrameRing::~FrameRing()
+{
+	delete[] this->slots;
+}
+
+WRITE_FRAMES *FrameRing::Claim()
+{
+	unsigned head = this->head.load(std::memory_order_relaxed);
+
+	if(head - this->tail.load(std::memory_order_acquire) == PIPELINE_SLOTS)
+		return NULL;
+	return &this->slots[head % PIPELINE_SLOTS];
+}
+
+// Taking the mutex once makes sure a consumer that just found the ring empty is waiting by now
+void FrameRing::Wake()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+	}
+	this->published.notify_one();
+}
+
+void FrameRing::Publish()
+{
+	this->head.store(this->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	Wake();
+}
+
+void FrameRing::Finish()
+{
+	this->finished.store(true, std::memory_order_release);
+	Wake();
+}
+
+WRITE_FRAMES *FrameRing::Peek()
+{
+	unsigned tail = this->tail.load(std::memory_order_relaxed);
+
+	if(tail == this->head.load(std::memory_order_acquire))
+		return NULL;
+	return &this->slots[tail % PIPELINE_SLOTS];
+}
+
+void FrameRing::WaitPublished()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	this->published.wait(lock, [this]{
+		return this->head.load(std::memory_order_acquire) != this->tail.load(std::memory_order_relaxed)
+			|| this->finished.load(std::memory_order_acquire);
+	});
+}
+
+void FrameRing::Release()
+{
+	this->tail.store(this->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void FrameRing::Stop()
+{
+	this->stopped.store(true, std::memory_order_release);
+}
+
+bool FrameRing::IsFinished()
+{
+	return this->finished.load(std::memory_order_acquire);
+}
+
+bool FrameRing::IsStopped()
+{
+	return this->stopped.load(std::memory_order_acquire);
+}
+
+///////////////// Preparation thread
+// Compares and hashes the blocks the writer handed back, so it only has to send and read
+static void CheckBlocks(PIPELINE *pipeline)
+{
+	unsigned done = pipeline->checks_done.load(std::memory_order_relaxed);
+	BLOCK_CHECK *check;
+	const uchar *data;
+	int offset;
+
+	while(done != pipeline->checks_queued.load(std::memory_order_acquire)){
+		check = &pipeline->checks[done % PIPELINE_CHECKS];
+		data = &pipeline->input_data[(check->block - pipeline->start_block) * BLOCK_SIZE];
+		for(check->good = 0; check->good < SECTORS_PER_BLOCK; check->good++){
+			offset = check->good * MAX_SECTOR_SIZE;
+			if(check->verify && compare_readback(&check->readback[offset], &data[offset], MAX_SECTOR_SIZE) != VERIFY_MATCH)
+				break;
+		}
+		if(check->good == SECTORS_PER_BLOCK)
+			sha256(data, BLOCK_SIZE, pipeline->digests[check->block]);
+		pipeline->checks_done.store(++done, std::memory_order_release);
+	}
+}
+
+// Waits for a free slot, checks blocks and draws the progress line meanwhile. NULL once the writer stopped
+static WRITE_FRAMES *NextSlot(PIPELINE *pipeline)
+{
+	WRITE_FRAMES *frames;
+
+	for(;;){
+		CheckBlocks(pipeline);
+		if((frames = pipeline->ring->Claim()))
+			return frames;
+		if(pipeline->ring->IsStopped())
+			return NULL;
+		pipeline->progress->Poll();
+		usleep(PIPELINE_POLL_US);
+	}
+}
+
+// Same commands WriteSector sends: 0xFF ranges of erased blocks left out, none bigger than the chunk size
+static bool PrepareBlock(PIPELINE *pipeline, int block)
+{
+	const uchar *data = &pipeline->input_data[block * BLOCK_SIZE];
+	bool erased = pipeline->erased[block];
+	WRITE_FRAMES *frames;
+	int start, end;
+
+	for(start = 0; start < BLOCK_SIZE; start = end){
+		if(!(frames = NextSlot(pipeline)))
+			return false;
+		// Commands never cross a sector
+		end = (start / MAX_SECTOR_SIZE + 1) * MAX_SECTOR_SIZE;
+		if(erased && is_blank(&data[start], min(SKIP_CHUNK, end - start))){
+			frames->block = pipeline->start_block + block;
+			frames->offset = start;
+			frames->send = false;
+			frames->blank = true;
+			frames->count = 0;
+			while(start < end && is_blank(&data[start], min(SKIP_CHUNK, end - start)))
+				start += SKIP_CHUNK;
+			frames->nBytes = min(start, end) - frames->offset;
+			end = min(start, end);
+		}
+		else {
+			if(erased){
+				end = min(end, start + SKIP_CHUNK);
+				while(end % MAX_SECTOR_SIZE && !is_blank(&data[end], SKIP_CHUNK))
+					end += SKIP_CHUNK;
+			}
+			end = min(end, start + pipeline->chunk_size);
+			BuildWriteFrames(frames, pipeline->start_block + block, start, &data[start], end - start);
+		}
+		frames->last = end == BLOCK_SIZE;
+		pipeline->ring->Publish();
+	}
+	return true;
+}
+
+static void PrepareFrames(PIPELINE *pipeline)
+{
+	log_set_prefix(pipeline->log_prefix);
+	for(int block = 0; block < pipeline->block_count; block++){
+		if(pipeline->changed[block] && !PrepareBlock(pipeline, block))
+			return;
+	}
+	pipeline->ring->Finish();
+
+	// Nothing left to prepare, the last blocks are still checked and the progress line drawn from here
+	while(!pipeline->ring->IsStopped()){
+		CheckBlocks(pipeline);
+		pipeline->progress->Poll();
+		usleep(PIPELINE_POLL_US);
+	}
+}
+
+///////////////// Class
+// The block is on the chip. One the checksums did not confirm is read back before it counts,
+// the preparation thread compares it
+bool XbitFlasher::FinishBlock(BLOCK_CHECK *check)
+{
+	check->verify = this->verify_mode || !this->block_confirmed[check->block];
+	for(int offset = 0; check->verify && offset < BLOCK_SIZE; offset += MAX_SECTOR_SIZE){
+		if(!ReadFlash(0, check->block, offset, &check->readback[offset], MAX_SECTOR_SIZE)){
+			log_printf("Failed to read back block %i @ 0x%04X\n", check->block, offset);
+			return false;
+		}
+	}
+	return true;
+}
+
+// What WriteBlock does after its last sector, once the preparation thread is done with the block
+bool XbitFlasher::CheckedBlock(const BLOCK_CHECK *check)
+{
+	for(int sector = 0; sector < check->good; sector++){
+		if(check->verify && !this->checksum_reported)
+			this->pacer.SectorGood();
+		this->sector_results[check->block][sector].writes++;
+		this->sector_results[check->block][sector].status = SECTOR_OK;
+	}
+	return check->good == SECTORS_PER_BLOCK;
+}
+
+// Slicing, checksums and blank tests run in a second thread and queue up ready CMD_WRITEs,
+// this thread only sends them and reads back, so neither that work nor the console gets between the reports.
+// Comparing and hashing the written blocks goes back to the other thread, the cache is only updated after.
+// A failed command or verify ends it, returns the first block (from start_block) that is not done
+int XbitFlasher::WritePipelined(int start_block, int block_count, const uchar *input_data, const bool *changed)
+{
+	FrameRing ring;
+	PIPELINE pipeline;
+	std::thread prep;
+	WRITE_FRAMES *frames;
+	BLOCK_CHECK *check;
+	bool erased[TOTAL_BLOCKS];
+	bool matched[TOTAL_BLOCKS];
+	uchar *readback = new uchar[PIPELINE_CHECKS * BLOCK_SIZE];
+	unsigned long block_base = this->progress.GetDone();
+	unsigned queued = 0, collected = 0;
+	int block = 0;
+	bool ok = true;
+
+	for(int i = 0; i < block_count; i++)
+		erased[i] = this->block_state[start_block + i] == BLOCK_ERASED;
+	memset(matched, 0, sizeof(matched));
+	pipeline.ring = &ring;
+	pipeline.progress = &this->progress;
+	pipeline.input_data = input_data;
+	pipeline.changed = changed;
+	pipeline.erased = erased;
+	pipeline.start_block = start_block;
+	pipeline.block_count = block_count;
+	pipeline.chunk_size = this->chunk_size;
+	snprintf(pipeline.log_prefix, sizeof(pipeline.log_prefix), "%s", log_get_prefix());
+	for(int i = 0; i < PIPELINE_CHECKS; i++)
+		pipeline.checks[i].readback = &readback[i * BLOCK_SIZE];
+	pipeline.checks_queued = 0;
+	pipeline.checks_done = 0;
+
+	// Up front, so the cache file is not touched while the reports go out
+	this->cache.InvalidateBlocks(start_block, block_count, changed);
+
+	this->progress.deferred = true;
+	prep = std::thread(PrepareFrames, &pipeline);
+	for(;;){
+		// Collected in order, a block that did not match is where the rest starts over
+		while(collected != pipeline.checks_done.load(std::memory_order_acquire)){
+			check = &pipeline.checks[collected++ % PIPELINE_CHECKS];
+			if(!CheckedBlock(check)){
+				block = check->block - start_block;
+				block_base = check->progress_base;
+				ok = false;
+				break;
+			}
+			matched[check->block] = true;
+		}
+		if(!ok)
+			break;
+
+		frames = ring.Peek();
+		if(!frames){
+			// Finished is set after the last slot was published, so look once more
+			if(ring.IsFinished() && !ring.Peek()){
+				if(collected == queued){
+					block = block_count;
+					break;
+				}
+				usleep(PIPELINE_POLL_US);
+				continue;
+			}
+			ring.WaitPublished();
+			continue;
+		}
+		// The last command of a block needs a check slot to hand it back in
+		if(frames->last && queued - collected == PIPELINE_CHECKS){
+			usleep(PIPELINE_POLL_US);
+			continue;
+		}
+		if(frames->block - start_block != block){
+			block = frames->block - start_block;
+			block_base = this->progress.GetDone();
+		}
+		if(!frames->send){
+			this->skipped_bytes += frames->nBytes;
+			this->progress.Advance(PROGRESS_OUT, frames->nBytes);
+		}
+		else
+			ok = SendFrames(frames);
+		if(ok && frames->last){
+			check = &pipeline.checks[queued % PIPELINE_CHECKS];
+			check->block = frames->block;
+			check->progress_base = block_base;
+			ok = FinishBlock(check);
+			if(ok)
+				pipeline.checks_queued.store(++queued, std::memory_order_release);
+		}
+		ring.Release();
+		if(!ok)
+			break;
+	}
+	ring.Stop();
+	prep.join();
+	this->progress.deferred = false;
+	delete[] readback;
+
+	for(int i = start_block; i < start_block + block_count; i++){
+		if(matched[i])
+			this->cache.Store(i, pipeline.digests[i], &input_data[(i - start_block) * BLOCK_SIZE + BlockCache::SampleOffset(i)]);
+	}
+	if(!ok){
+		// WriteBlock erases it again first, whatever part of it reached the chip
+		log_printf("Block %i: write failed, going on block by block\n", start_block + block);
+		this->progress.SetDone(block_base);
+		this->progress.Retry();
+	}
+	return block;
+}
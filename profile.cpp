@@ -0,0 +1,213 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Host controller timing profiles
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+#include "transport.h"
+
+static int ParseMode(const char *name, const char **names, int count)
+{
+	for(int i = 0; i < count; i++){
+		if(!strcmp(name, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+///////////////// Profile files
+// What a chip starts with when nothing is known: the path and pacing that work everywhere
+void ProfileDefaults(PROFILE *profile)
+{
+	memset(profile, 0, sizeof(PROFILE));
+	snprintf(profile->controller, sizeof(profile->controller), "unknown");
+	profile->out_mode = XFER_OUT_REPORT;
+	profile->in_mode = XFER_IN_FEATURE;
+	profile->pacing_us = PACING_START_US;
+	profile->chunk_size = MAX_SECTOR_SIZE;
+}
+
+bool ProfileSave(const PROFILE *profile, const char *filename)
+{
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if(f == NULL)
+		return false;
+
+	fprintf(f, "%s %i\n", PROFILE_MAGIC, PROFILE_VERSION);
+	fprintf(f, "controller %s\n", profile->controller);
+	fprintf(f, "out %s\nin %s\n", xfer_out_names[profile->out_mode], xfer_in_names[profile->in_mode]);
+	fprintf(f, "pacing %i\nchunk %i\nround %i\ncalibrated %i\n", profile->pacing_us, profile->chunk_size, profile->round_us,
+		profile->calibrated_us);
+	fprintf(f, "throughput %i\nfailure_ppm %i\nruns %i\nbad_runs %i\n", profile->throughput, profile->failure_ppm,
+		profile->runs, profile->bad_runs);
+	return fclose(f) == 0;
+}
+
+bool ProfileLoad(PROFILE *profile, const char *filename)
+{
+	char line[512], word[MAX_STR];
+	int version, value;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if(f == NULL)
+		return false;
+
+	ProfileDefaults(profile);
+	if(!fgets(line, sizeof(line), f) || sscanf(line, "%254s %i", word, &version) != 2
+		|| strcmp(word, PROFILE_MAGIC) || version != PROFILE_VERSION){
+		fclose(f);
+		return false;
+	}
+	while(fgets(line, sizeof(line), f)){
+		if(sscanf(line, "controller %254s", word) == 1)
+			snprintf(profile->controller, sizeof(profile->controller), "%s", word);
+		else if(sscanf(line, "out %254s", word) == 1 && (value = ParseMode(word, xfer_out_names, XFER_OUT_COUNT)) >= 0)
+			profile->out_mode = value;
+		else if(sscanf(line, "in %254s", word) == 1 && (value = ParseMode(word, xfer_in_names, XFER_IN_COUNT)) >= 0)
+			profile->in_mode = value;
+		else if(sscanf(line, "pacing %i", &value) == 1 && value >= PACING_MIN_US && value <= PACING_START_US)
+			profile->pacing_us = value;
+		else if(sscanf(line, "chunk %i", &value) == 1 && value >= CHUNK_MIN && value <= MAX_SECTOR_SIZE)
+			profile->chunk_size = value;
+		else if(sscanf(line, "round %i", &value) == 1)
+			profile->round_us = value;
+		else if(sscanf(line, "calibrated %i", &value) == 1 && value >= 0 && value <= PACING_START_US)
+			profile->calibrated_us = value;
+		else if(sscanf(line, "throughput %i", &value) == 1)
+			profile->throughput = value;
+		else if(sscanf(line, "failure_ppm %i", &value) == 1)
+			profile->failure_ppm = value;
+		else if(sscanf(line, "runs %i", &value) == 1)
+			profile->runs = value;
+		else if(sscanf(line, "bad_runs %i", &value) == 1)
+			profile->bad_runs = value;
+		else {
+			log_printf("%s: cannot parse: %s", filename, line);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+	if(profile->pacing_us < profile->calibrated_us)
+		profile->pacing_us = profile->calibrated_us;
+	return true;
+}
+
+// The saved path is no use, start over from the one that works everywhere
+static void DefaultPath(PROFILE *profile)
+{
+	profile->out_mode = XFER_OUT_REPORT;
+	profile->in_mode = XFER_IN_FEATURE;
+	profile->pacing_us = PACING_START_US;
+}
+
+///////////////// Class
+// One profile per host controller and device path, the same chip behaves differently on another controller.
+// The path is the one the transport opened, also when it picked the chip itself
+bool XbitFlasher::GetProfilePath(char *filename, int size)
+{
+	char controller[MAX_STR], key[MAX_STR * 2];
+	const char *path = this->transport->GetPath();
+
+	if(!this->transport->GetController(controller, sizeof(controller)))
+		snprintf(controller, sizeof(controller), "unknown");
+	snprintf(key, sizeof(key), "%s-%s", controller, path[0] ? path : "default");
+	return state_path(this->transport->GetName(), key, PROFILE_EXT, filename, size);
+}
+
+bool XbitFlasher::ApplyProfile()
+{
+	if(!this->transport->SetModes(this->profile.out_mode, this->profile.in_mode))
+		return false;
+	this->pacer.SetStart(this->profile.pacing_us);
+	this->chunk_size = this->profile.chunk_size;
+	return true;
+}
+
+// Warm start: what worked last time on this controller, no warm-up or calibration.
+// Once per flasher, a reopen in the middle of a job keeps what the job adapted to
+void XbitFlasher::LoadProfile()
+{
+	char controller[MAX_STR], last[128] = "";
+
+	if(!this->use_profile || this->profile_file[0])
+		return;
+	if(!GetProfilePath(this->profile_file, sizeof(this->profile_file))){
+		this->profile_file[0] = 0;
+		return;
+	}
+
+	if(!ProfileLoad(&this->profile, this->profile_file)){
+		ProfileDefaults(&this->profile);
+		if(this->transport->GetController(controller, sizeof(controller)))
+			snprintf(this->profile.controller, sizeof(this->profile.controller), "%s", controller);
+		return;
+	}
+	if(this->profile.bad_runs >= PROFILE_MAX_BAD_RUNS){
+		log_printf("Profile: %i failed jobs in a row on %s, back to the defaults\n", this->profile.bad_runs, this->profile.controller);
+		DefaultPath(&this->profile);
+		this->profile.chunk_size = MAX_SECTOR_SIZE;
+		ApplyProfile();
+		return;
+	}
+	if(!ApplyProfile()){
+		log_printf("Profile: %s has no %s OUT/%s IN path, using the defaults\n", this->transport->GetName(),
+			xfer_out_names[this->profile.out_mode], xfer_in_names[this->profile.in_mode]);
+		DefaultPath(&this->profile);
+		ApplyProfile();
+		return;
+	}
+	// The host or the chip may have changed since
+	if(!GetStatus() || !IsValidStatus()){
+		log_printf("Profile: saved %s OUT/%s IN path does not answer, using the defaults\n",
+			xfer_out_names[this->profile.out_mode], xfer_in_names[this->profile.in_mode]);
+		DefaultPath(&this->profile);
+		Settle();
+		return;
+	}
+	if(this->profile.throughput)
+		snprintf(last, sizeof(last), ", last %.1f KB/s with %i failures per million reports",
+			this->profile.throughput / 1024.0, this->profile.failure_ppm);
+	log_printf("Profile: %s, %s OUT/%s IN, %i us pacing, %i byte chunks%s\n", this->profile.controller,
+		xfer_out_names[this->profile.out_mode], xfer_in_names[this->profile.in_mode], this->profile.pacing_us,
+		this->profile.chunk_size, last);
+}
+
+// After every job: keep what the job ended up with if it went through, count it against the profile otherwise
+void XbitFlasher::RecordJob(bool ok)
+{
+	int pacing;
+
+	if(!this->profile_file[0])
+		return;
+
+	this->profile.runs++;
+	if(!ok)
+		this->profile.bad_runs++;
+	else {
+		this->profile.bad_runs = 0;
+		this->profile.out_mode = this->transport->GetOutMode();
+		this->profile.in_mode = this->transport->GetInMode();
+		// Only a job that never had to back off, and narrowed on confirmed sectors only, tells how fast this host can go.
+		// Still never faster than calibration measured, nor slower than the default
+		if(!this->pacer.GetFailures() && this->pacer.GetConfirmed()){
+			pacing = this->pacer.GetDelay();
+			if(pacing < this->profile.calibrated_us)
+				pacing = this->profile.calibrated_us;
+			this->profile.pacing_us = pacing < PACING_START_US ? pacing : PACING_START_US;
+		}
+		this->profile.chunk_size = this->chunk_size;
+		if(this->pacer.GetReports()){
+			this->profile.throughput = this->pacer.GetThroughput();
+			this->profile.failure_ppm = (int)(this->pacer.GetFailures() * 1000000ULL / this->pacer.GetReports());
+		}
+	}
+	if(!ProfileSave(&this->profile, this->profile_file))
+		log_printf("Profile: failed to write %s\n", this->profile_file);
+}
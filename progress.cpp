@@ -0,0 +1,133 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Progress display
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <unistd.h>
+
+#include "xbit.h"
+
+ProgressMeter::ProgressMeter()
+{
+	this->enabled = true;
+	this->redraw = isatty(fileno(stderr));
+	this->deferred = false;
+	this->active = false;
+	this->label = "";
+	BeginJob(1);
+}
+
+// Overall progress is shown once a job spans more than one bank
+void ProgressMeter::BeginJob(int banks)
+{
+	this->banks = banks;
+	this->banks_done = 0;
+}
+
+void ProgressMeter::EndBank()
+{
+	if(this->banks_done < this->banks)
+		this->banks_done++;
+}
+
+void ProgressMeter::Start(const char *label, int bank, unsigned long total, int unit)
+{
+	this->label = label;
+	this->bank = bank;
+	this->total = total;
+	this->unit = unit;
+	this->done = 0;
+	this->retries = 0;
+	this->active = true;
+	this->start_us = get_time_us();
+	this->next_draw_us = this->start_us;
+}
+
+void ProgressMeter::Advance(int unit, unsigned long amount)
+{
+	// Only what the current phase counts, e.g. not the readback during a write
+	if(!this->active || unit != this->unit)
+		return;
+	this->done += amount;
+	if(!this->deferred)
+		Poll();
+}
+
+void ProgressMeter::Poll()
+{
+	unsigned long long now;
+
+	if(!this->active || !this->enabled)
+		return;
+	now = get_time_us();
+	if(now < this->next_draw_us)
+		return;
+	this->next_draw_us = now + (this->redraw ? 1000000 / PROGRESS_HZ : PROGRESS_LOG_SECONDS * 1000000);
+	Draw(false);
+}
+
+unsigned long ProgressMeter::GetDone()
+{
+	return this->done;
+}
+
+void ProgressMeter::SetDone(unsigned long done)
+{
+	this->done = done;
+}
+
+void ProgressMeter::Retry()
+{
+	this->retries++;
+}
+
+void ProgressMeter::Finish()
+{
+	if(!this->active)
+		return;
+	if(this->enabled)
+		Draw(true);
+	this->active = false;
+}
+
+void ProgressMeter::Draw(bool final)
+{
+	char line[256];
+	int len, remaining;
+	double seconds = (get_time_us() - this->start_us) / 1000000.0;
+	unsigned long done = this->done.load();
+	double fraction;
+
+	if(done > this->total)
+		done = this->total;
+	fraction = this->total ? (double)done / this->total : 1;
+
+	len = snprintf(line, sizeof(line), "%s", this->label.load());
+	if(this->bank)
+		len += snprintf(line + len, sizeof(line) - len, " bank %i", this->bank);
+	if(this->unit == PROGRESS_BLOCKS)
+		len += snprintf(line + len, sizeof(line) - len, " %3i%% %lu/%lu blocks", (int)(fraction * 100), done, this->total);
+	else {
+		len += snprintf(line + len, sizeof(line) - len, " %3i%% %lu/%lu KB", (int)(fraction * 100), done / 1024, this->total / 1024);
+		if(seconds > 0)
+			len += snprintf(line + len, sizeof(line) - len, " %.1f KB/s", done / seconds / 1024);
+	}
+	if(final)
+		len += snprintf(line + len, sizeof(line) - len, " in %.1f s", seconds);
+	else if(done){
+		remaining = (int)(seconds * (this->total - done) / done);
+		len += snprintf(line + len, sizeof(line) - len, " ETA %i:%02i", remaining / 60, remaining % 60);
+	}
+	if(this->retries)
+		len += snprintf(line + len, sizeof(line) - len, " retries %i", this->retries.load());
+	if(this->banks > 1)
+		len += snprintf(line + len, sizeof(line) - len, " [bank %i/%i, %i%% overall]", this->banks_done + 1, this->banks,
+			(int)((this->banks_done + fraction) * 100 / this->banks));
+
+	if(this->redraw)
+		log_status(line, final);
+	else
+		log_printf("%s\n", line);
+}
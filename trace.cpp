@@ -0,0 +1,185 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Protocol trace
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+
+#define SWAP_UINT16(x) ((((x)&0xff00)>>8) | (((x)&0x00ff)<<8))
+
+#define TRACE_HEX_PREVIEW		8	// Payload bytes shown per data report without hex mode
+
+typedef struct
+{
+	char magic[4];
+	uint32 version;
+	uint32 count;
+} TRACE_HEADER;
+
+///////////////// Ring
+TraceRing::TraceRing()
+{
+	this->records = new TRACE_RECORD[TRACE_RECORDS];
+	Clear();
+}
+
+TraceRing::~TraceRing()
+{
+	delete[] this->records;
+}
+
+void TraceRing::Clear()
+{
+	this->next = 0;
+	this->count = 0;
+}
+
+const TRACE_RECORD *TraceRing::Record(uchar dir, const REPORT_BUF *report, int result, unsigned long long time_us)
+{
+	TRACE_RECORD *record = &this->records[this->next];
+
+	record->time_us = time_us;
+	record->result = result;
+	record->dir = dir;
+	memcpy(&record->report, report, sizeof(REPORT_BUF));
+
+	this->next = (this->next + 1) % TRACE_RECORDS;
+	if(this->count < TRACE_RECORDS)
+		this->count++;
+	return record;
+}
+
+int TraceRing::GetCount()
+{
+	return this->count;
+}
+
+const TRACE_RECORD *TraceRing::Get(int index)
+{
+	if(index < 0 || index >= this->count)
+		return NULL;
+	return &this->records[(this->next - this->count + index + TRACE_RECORDS) % TRACE_RECORDS];
+}
+
+bool TraceRing::Save(const char *filename)
+{
+	TRACE_HEADER header;
+	FILE *f;
+
+	f = fopen(filename, "wb");
+	if(f == NULL)
+		return false;
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.count = this->count;
+	fwrite(&header, sizeof(header), 1, f);
+	for(int i = 0; i < this->count; i++)
+		fwrite(Get(i), sizeof(TRACE_RECORD), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool TraceRing::Load(const char *filename)
+{
+	TRACE_HEADER header;
+	TRACE_RECORD record;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if(f == NULL)
+		return false;
+
+	if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+		|| header.version != TRACE_VERSION){
+		fclose(f);
+		return false;
+	}
+
+	Clear();
+	for(uint32 i = 0; i < header.count && fread(&record, sizeof(record), 1, f) == 1; i++)
+		Record(record.dir, &record.report, record.result, record.time_us);
+	fclose(f);
+	return true;
+}
+
+///////////////// Decoder
+static const char *cmd_names[] = {
+	"?", "RESET", "ERASE", "WRITE", "READ", "GET_STATUS", "SET_REGS", "SET_PAGE", "SET_VM"
+};
+
+void TraceDecoderInit(TRACE_DECODER *decoder)
+{
+	decoder->first_us = 0;
+	decoder->remaining = 0;
+	decoder->hex = false;
+}
+
+void TraceDecode(TRACE_DECODER *decoder, const TRACE_RECORD *record, char *line, int size)
+{
+	const MCU_CMD *cmd = &record->report.report;
+	int len, count;
+
+	if(!decoder->first_us)
+		decoder->first_us = record->time_us;
+	len = snprintf(line, size, "%11.6f %-3s ", (record->time_us - decoder->first_us) / 1000000.0,
+		record->dir == TRACE_OUT ? "OUT" : "IN");
+
+	if(record->result != sizeof(REPORT_BUF)){
+		snprintf(line + len, size - len, "FAILED (%i)", record->result);
+		return;
+	}
+
+	// Data follows CMD_WRITE (out) and CMD_READ (in), 63 bytes after the zero command byte
+	if(decoder->remaining && cmd->u.cmd == 0){
+		count = decoder->remaining < CMD_SIZE - 1 ? decoder->remaining : CMD_SIZE - 1;
+		decoder->remaining -= count;
+		len += snprintf(line + len, size - len, "DATA %2i bytes:", count);
+		for(int i = 0; i < count && (decoder->hex || i < TRACE_HEX_PREVIEW) && len < size - 4; i++)
+			len += snprintf(line + len, size - len, " %02X", cmd->u.buffer[1 + i]);
+		if(!decoder->hex && count > TRACE_HEX_PREVIEW)
+			snprintf(line + len, size - len, " ...");
+		return;
+	}
+
+	if(record->dir == TRACE_IN && cmd->u.cmd == CMD_GET_STATUS){
+		snprintf(line + len, size - len, "STATUS currentCmd=%02X page=%i vm=%02X ret=%02X checkSum=%02X",
+			cmd->u.status.currentCmd, cmd->u.status.page, cmd->u.status.vm,
+			cmd->u.status.ret, cmd->u.status.checkSum);
+		return;
+	}
+
+	decoder->remaining = 0;
+	switch(cmd->u.cmd){
+		case 0:
+			// The command that started it has already left the ring
+			snprintf(line + len, size - len, "DATA (header not in trace)");
+			break;
+		case CMD_READ:
+		case CMD_WRITE:
+			decoder->remaining = SWAP_UINT16(cmd->u.rw.nBytes);
+			snprintf(line + len, size - len, "%s flash=%i address=%04X nBytes=%i", cmd_names[cmd->u.cmd],
+				cmd->u.rw.flash, SWAP_UINT16(cmd->u.rw.address), SWAP_UINT16(cmd->u.rw.nBytes));
+			break;
+		case CMD_ERASE:
+			snprintf(line + len, size - len, "ERASE flash=%i address=%04X",
+				cmd->u.erase.flash, SWAP_UINT16(cmd->u.erase.address));
+			break;
+		case CMD_SET_REGS:
+		case CMD_SET_PAGE:
+		case CMD_SET_VM:
+			snprintf(line + len, size - len, "%s page=%i vm=%02X", cmd_names[cmd->u.cmd],
+				cmd->u.setRegs.page, cmd->u.setRegs.vm);
+			break;
+		case CMD_RESET:
+		case CMD_GET_STATUS:
+			snprintf(line + len, size - len, "%s", cmd_names[cmd->u.cmd]);
+			break;
+		default:
+			snprintf(line + len, size - len, "UNKNOWN cmd=%02X", cmd->u.cmd);
+			break;
+	}
+}
@@ -0,0 +1,42 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Trace decoder
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "xbit.h"
+
+int main(int argc, char* argv[])
+{
+	const char *filename = NULL;
+	char line[512];
+	TRACE_DECODER decoder;
+	TraceRing trace;
+
+	TraceDecoderInit(&decoder);
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--hex"))
+			decoder.hex = true;
+		else
+			filename = argv[i];
+	}
+	if(!filename){
+		printf("Usage: %s [--hex] <trace file>\n", argv[0]);
+		printf("Prints a protocol trace saved by xbit_flasher, --hex shows the complete data reports\n");
+		return 1;
+	}
+
+	if(!trace.Load(filename)){
+		printf("Failed to load trace %s\n", filename);
+		return 2;
+	}
+
+	printf("%i reports\n", trace.GetCount());
+	for(int i = 0; i < trace.GetCount(); i++){
+		TraceDecode(&decoder, trace.Get(i), line, sizeof(line));
+		printf("%s\n", line);
+	}
+	return 0;
+}
@@ -0,0 +1,617 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0) - Transports
+ *********************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <ctype.h>
+#include <limits.h>
+#include <wchar.h>
+#ifdef HAVE_LIBUSB
+#include <libusb-1.0/libusb.h>
+#endif
+
+#include "transport.h"
+#include "emulator.h"
+
+#define MEMORY_PATH_PREFIX		"mem:"
+#define USB_TIMEOUT_MS			1000
+
+static const char *transport_names[TRANSPORT_COUNT] = {"hid", "libusb", "mem"};
+const char *xfer_out_names[XFER_OUT_COUNT] = {"output", "feature"};
+const char *xfer_in_names[XFER_IN_COUNT] = {"feature", "interrupt"};
+
+// Name of the device above the root hub (usbN) in a sysfs device path, e.g.
+// /sys/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0 -> 0000:00:14.0
+static bool sysfs_controller(const char *sysfs_path, char *name, int size)
+{
+#ifdef __linux__
+	char real[PATH_MAX], *usb, *parent;
+
+	if(!realpath(sysfs_path, real))
+		return false;
+	for(usb = strstr(real, "/usb"); usb && !isdigit((uchar)usb[4]); usb = strstr(usb + 1, "/usb"))
+		;
+	if(!usb)
+		return false;
+	*usb = 0;
+	parent = strrchr(real, '/');
+	if(!parent || !parent[1])
+		return false;
+	snprintf(name, size, "%s", parent + 1);
+	return true;
+#else
+	return false;
+#endif
+}
+
+Transport *Transport::Create(int type)
+{
+	switch(type){
+		case TRANSPORT_HID:
+			return new HidTransport();
+#ifdef HAVE_LIBUSB
+		case TRANSPORT_LIBUSB:
+			return new LibusbTransport();
+#endif
+		case TRANSPORT_MEMORY:
+			return new MemoryTransport();
+	}
+	return NULL;
+}
+
+Transport::Transport()
+{
+	this->out_mode = XFER_OUT_REPORT;
+	this->in_mode = XFER_IN_FEATURE;
+	this->path[0] = 0;
+}
+
+const char *Transport::GetPath()
+{
+	return this->path;
+}
+
+bool Transport::GetController(char *name, int size)
+{
+	return false;
+}
+
+int Transport::WriteStream(const uchar *reports, int length, int count, int depth)
+{
+	for(int i = 0; i < count; i++){
+		if(Write(&reports[i * length], length) != length)
+			return i;
+	}
+	return count;
+}
+
+bool Transport::CanQueue()
+{
+	return false;
+}
+
+bool Transport::SetModes(int out_mode, int in_mode)
+{
+	if(out_mode < 0 || out_mode >= XFER_OUT_COUNT || in_mode < 0 || in_mode >= XFER_IN_COUNT)
+		return false;
+	this->out_mode = out_mode;
+	this->in_mode = in_mode;
+	return true;
+}
+
+int Transport::GetOutMode()
+{
+	return this->out_mode;
+}
+
+int Transport::GetInMode()
+{
+	return this->in_mode;
+}
+
+int Transport::ParseType(const char *name)
+{
+	for(int i = 0; i < TRANSPORT_COUNT; i++){
+		if(!strcmp(name, transport_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+///////////////// hidapi
+int HidTransport::instances = 0;
+
+HidTransport::HidTransport()
+{
+	// Initialize the hidapi library, once for all instances
+	if(!instances++)
+		hid_init();
+	this->handle = NULL;
+}
+
+HidTransport::~HidTransport()
+{
+	Close();
+	// Finalize the hidapi library
+	if(!--instances)
+		hid_exit();
+}
+
+int HidTransport::Enumerate(char paths[][MAX_STR], int max_devices)
+{
+	int count = 0;
+	struct hid_device_info *devs, *cur;
+
+	devs = hid_enumerate(ST_VENDOR_ID, ST_PRODUCT_ID);
+	for(cur = devs; cur && count < max_devices; cur = cur->next){
+		snprintf(paths[count], MAX_STR, "%s", cur->path);
+		count++;
+	}
+	hid_free_enumeration(devs);
+	return count;
+}
+
+bool HidTransport::Open(const char *path)
+{
+	char paths[1][MAX_STR];
+
+	// Open the device by path if we know it, otherwise the first one
+	// with our VID and PID. The path tells the host controller later.
+	if(!path){
+		if(!Enumerate(paths, 1))
+			return false;
+		path = paths[0];
+	}
+	this->handle = hid_open_path(path);
+	snprintf(this->path, sizeof(this->path), "%s", this->handle ? path : "");
+	return this->handle != NULL;
+}
+
+void HidTransport::Close()
+{
+	if(this->handle)
+		hid_close(this->handle);
+	this->handle = NULL;
+}
+
+bool HidTransport::IsOpen()
+{
+	return this->handle != NULL;
+}
+
+int HidTransport::Write(const uchar *data, int length)
+{
+	if(this->out_mode == XFER_OUT_FEATURE)
+		return hid_send_feature_report(this->handle, data, length);
+	return hid_write(this->handle, data, length);
+}
+
+int HidTransport::GetFeature(uchar *data, int length)
+{
+	int res;
+
+	/* NOTE: Dont use hid_read, unless calibration found it to work on this host */
+	if(this->in_mode != XFER_IN_INTERRUPT)
+		return hid_get_feature_report(this->handle, data, length);
+
+	// Input reports come without the report ID byte, nothing queued within the timeout is a failure
+	data[0] = 0;
+	res = hid_read_timeout(this->handle, data + 1, length - 1, USB_TIMEOUT_MS);
+	return res <= 0 ? -1 : res + 1;
+}
+
+bool HidTransport::GetManufacturer(wchar_t *str, int maxlen)
+{
+	return hid_get_manufacturer_string(this->handle, str, maxlen) == 0;
+}
+
+bool HidTransport::GetProduct(wchar_t *str, int maxlen)
+{
+	return hid_get_product_string(this->handle, str, maxlen) == 0;
+}
+
+const char *HidTransport::GetName()
+{
+	return transport_names[TRANSPORT_HID];
+}
+
+bool HidTransport::GetController(char *name, int size)
+{
+	char sysfs[MAX_STR];
+	int bus;
+
+	// hidraw backend: /dev/hidraw3, libusb backend: 0001:0005:00 (bus:address:interface)
+	if(!strncmp(this->path, "/dev/", 5))
+		snprintf(sysfs, sizeof(sysfs), "/sys/class/hidraw/%s/device", this->path + 5);
+	else if(sscanf(this->path, "%x:%*x:%*x", &bus) == 1)
+		snprintf(sysfs, sizeof(sysfs), "/sys/bus/usb/devices/usb%i", bus);
+	else
+		return false;
+	return sysfs_controller(sysfs, name, size);
+}
+
+///////////////// libusb
+#ifdef HAVE_LIBUSB
+#define HID_GET_REPORT			0x01
+#define HID_SET_REPORT			0x09
+#define HID_REPORT_TYPE_OUTPUT	0x02
+#define HID_REPORT_TYPE_FEATURE	0x03
+
+// Asynchronous OUT transfers of one WriteStream. The callbacks run from the transport's own
+// event loop, so only ever on the thread that called WriteStream
+typedef struct
+{
+	struct libusb_transfer *idle[QUEUE_DEPTH_MAX];
+	int idle_count;
+	int in_flight;
+	int done;
+	bool failed;
+} USB_STREAM;
+
+static void LIBUSB_CALL stream_callback(struct libusb_transfer *transfer)
+{
+	USB_STREAM *stream = (USB_STREAM *)transfer->user_data;
+
+	stream->in_flight--;
+	if(transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == transfer->length)
+		stream->done++;
+	else
+		stream->failed = true;
+	stream->idle[stream->idle_count++] = transfer;
+}
+
+LibusbTransport::LibusbTransport()
+{
+	if(libusb_init(&this->context) < 0)
+		this->context = NULL;
+	this->handle = NULL;
+	this->bus = 0;
+	this->interface_number = 0;
+	this->ep_out = 0;
+	this->ep_in = 0;
+	this->iManufacturer = 0;
+	this->iProduct = 0;
+}
+
+LibusbTransport::~LibusbTransport()
+{
+	Close();
+	if(this->context)
+		libusb_exit(this->context);
+}
+
+int LibusbTransport::Enumerate(char paths[][MAX_STR], int max_devices)
+{
+	libusb_device **list;
+	struct libusb_device_descriptor desc;
+	int count = 0;
+	ssize_t n;
+
+	n = libusb_get_device_list(this->context, &list);
+	for(ssize_t i = 0; i < n && count < max_devices; i++){
+		if(libusb_get_device_descriptor(list[i], &desc) < 0)
+			continue;
+		if(desc.idVendor != ST_VENDOR_ID || desc.idProduct != ST_PRODUCT_ID)
+			continue;
+		snprintf(paths[count], MAX_STR, "%03d:%03d",
+			libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+		count++;
+	}
+	if(n >= 0)
+		libusb_free_device_list(list, 1);
+	return count;
+}
+
+bool LibusbTransport::Open(const char *path)
+{
+	libusb_device **list;
+	libusb_device *dev = NULL;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *config;
+	char dev_path[MAX_STR];
+	ssize_t n;
+
+	n = libusb_get_device_list(this->context, &list);
+	for(ssize_t i = 0; i < n && !dev; i++){
+		if(libusb_get_device_descriptor(list[i], &desc) < 0)
+			continue;
+		if(desc.idVendor != ST_VENDOR_ID || desc.idProduct != ST_PRODUCT_ID)
+			continue;
+		snprintf(dev_path, sizeof(dev_path), "%03d:%03d",
+			libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+		if(!path || !strcmp(path, dev_path)){
+			dev = list[i];
+			snprintf(this->path, sizeof(this->path), "%s", dev_path);
+			this->bus = libusb_get_bus_number(list[i]);
+			this->iManufacturer = desc.iManufacturer;
+			this->iProduct = desc.iProduct;
+		}
+	}
+	if(dev && libusb_open(dev, &this->handle) < 0)
+		this->handle = NULL;
+
+	// Look for the interrupt endpoints, without OUT reports go out as SET_REPORT like hidapi does
+	this->ep_out = 0;
+	this->ep_in = 0;
+	this->interface_number = 0;
+	if(this->handle && libusb_get_active_config_descriptor(dev, &config) == 0){
+		const struct libusb_interface_descriptor *intf = &config->interface[0].altsetting[0];
+		this->interface_number = intf->bInterfaceNumber;
+		for(int i = 0; i < intf->bNumEndpoints; i++){
+			const struct libusb_endpoint_descriptor *ep = &intf->endpoint[i];
+			if((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+				continue;
+			if(ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+				this->ep_in = ep->bEndpointAddress;
+			else
+				this->ep_out = ep->bEndpointAddress;
+		}
+		libusb_free_config_descriptor(config);
+	}
+	if(n >= 0)
+		libusb_free_device_list(list, 1);
+	if(!this->handle)
+		return false;
+
+	libusb_set_auto_detach_kernel_driver(this->handle, 1);
+	if(libusb_claim_interface(this->handle, this->interface_number) < 0){
+		libusb_close(this->handle);
+		this->handle = NULL;
+		return false;
+	}
+	return true;
+}
+
+void LibusbTransport::Close()
+{
+	if(!this->handle)
+		return;
+	libusb_release_interface(this->handle, this->interface_number);
+	libusb_close(this->handle);
+	this->handle = NULL;
+}
+
+bool LibusbTransport::IsOpen()
+{
+	return this->handle != NULL;
+}
+
+int LibusbTransport::Write(const uchar *data, int length)
+{
+	int res, transferred = 0;
+
+	// Report ID 0 means the chip does not use report IDs, it is not sent
+	if(this->ep_out && this->out_mode == XFER_OUT_REPORT){
+		res = libusb_interrupt_transfer(this->handle, this->ep_out, (uchar *)data + 1, length - 1,
+			&transferred, USB_TIMEOUT_MS);
+		return res < 0 ? -1 : transferred + 1;
+	}
+	res = libusb_control_transfer(this->handle,
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		HID_SET_REPORT, ((this->out_mode == XFER_OUT_FEATURE ? HID_REPORT_TYPE_FEATURE : HID_REPORT_TYPE_OUTPUT) << 8) | data[0],
+		this->interface_number, (uchar *)data + 1, length - 1, USB_TIMEOUT_MS);
+	return res < 0 ? -1 : res + 1;
+}
+
+int LibusbTransport::GetFeature(uchar *data, int length)
+{
+	int res, transferred = 0;
+
+	if(this->in_mode == XFER_IN_INTERRUPT){
+		data[0] = 0;
+		res = libusb_interrupt_transfer(this->handle, this->ep_in, data + 1, length - 1, &transferred, USB_TIMEOUT_MS);
+		return res < 0 || !transferred ? -1 : transferred + 1;
+	}
+	res = libusb_control_transfer(this->handle,
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		HID_GET_REPORT, (HID_REPORT_TYPE_FEATURE << 8) | data[0], this->interface_number,
+		data + 1, length - 1, USB_TIMEOUT_MS);
+	return res < 0 ? -1 : res + 1;
+}
+
+bool LibusbTransport::GetString(uchar index, wchar_t *str, int maxlen)
+{
+	uchar buf[MAX_STR];
+	int len;
+
+	len = libusb_get_string_descriptor_ascii(this->handle, index, buf, sizeof(buf));
+	if(len < 0)
+		return false;
+	swprintf(str, maxlen, L"%.*s", len, buf);
+	return true;
+}
+
+bool LibusbTransport::GetManufacturer(wchar_t *str, int maxlen)
+{
+	return GetString(this->iManufacturer, str, maxlen);
+}
+
+bool LibusbTransport::GetProduct(wchar_t *str, int maxlen)
+{
+	return GetString(this->iProduct, str, maxlen);
+}
+
+const char *LibusbTransport::GetName()
+{
+	return transport_names[TRANSPORT_LIBUSB];
+}
+
+// One bus per host controller, the bus number stands in where there is no sysfs
+bool LibusbTransport::GetController(char *name, int size)
+{
+	char sysfs[MAX_STR];
+
+	snprintf(sysfs, sizeof(sysfs), "/sys/bus/usb/devices/usb%i", this->bus);
+	if(!sysfs_controller(sysfs, name, size))
+		snprintf(name, size, "usb%i", this->bus);
+	return true;
+}
+
+// Interrupt OUT transfers on one endpoint complete in order, so "done" is the reports the chip got in a row
+int LibusbTransport::WriteStream(const uchar *reports, int length, int count, int depth)
+{
+	struct libusb_transfer *transfers[QUEUE_DEPTH_MAX], *transfer;
+	USB_STREAM stream;
+	bool cancelled = false;
+	int next = 0;
+
+	// SET_REPORT goes over the control pipe, one at a time
+	if(!this->ep_out || this->out_mode != XFER_OUT_REPORT || depth <= 1)
+		return Transport::WriteStream(reports, length, count, depth);
+
+	memset(&stream, 0, sizeof(stream));
+	depth = depth < QUEUE_DEPTH_MAX ? depth : QUEUE_DEPTH_MAX;
+	for(int i = 0; i < depth; i++){
+		transfers[i] = libusb_alloc_transfer(0);
+		if(!transfers[i]){
+			depth = i;
+			break;
+		}
+		stream.idle[stream.idle_count++] = transfers[i];
+	}
+	if(!depth)
+		return Transport::WriteStream(reports, length, count, 1);
+
+	while(stream.in_flight || (next < count && !stream.failed)){
+		while(stream.idle_count && next < count && !stream.failed){
+			transfer = stream.idle[--stream.idle_count];
+			libusb_fill_interrupt_transfer(transfer, this->handle, this->ep_out, (uchar *)&reports[next * length] + 1, length - 1,
+				stream_callback, &stream, USB_TIMEOUT_MS);
+			if(libusb_submit_transfer(transfer) < 0){
+				stream.idle[stream.idle_count++] = transfer;
+				stream.failed = true;
+				break;
+			}
+			stream.in_flight++;
+			next++;
+		}
+		// Whatever is queued behind a failed report would reach the chip with a gap in the data
+		if(stream.failed && !cancelled){
+			for(int i = 0; i < depth; i++)
+				libusb_cancel_transfer(transfers[i]);
+			cancelled = true;
+		}
+		if(stream.in_flight)
+			libusb_handle_events_completed(this->context, NULL);
+	}
+
+	for(int i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	return stream.done;
+}
+
+// Before Open the endpoints are not known yet, the X-Bit has an interrupt OUT one
+bool LibusbTransport::CanQueue()
+{
+	return !this->handle || (this->ep_out && this->out_mode == XFER_OUT_REPORT);
+}
+
+bool LibusbTransport::SetModes(int out_mode, int in_mode)
+{
+	if(in_mode == XFER_IN_INTERRUPT && !this->ep_in)
+		return false;
+	return Transport::SetModes(out_mode, in_mode);
+}
+#endif
+
+///////////////// In-memory
+MemoryTransport::MemoryTransport()
+{
+	EmuAttach();
+	this->emu = NULL;
+}
+
+MemoryTransport::~MemoryTransport()
+{
+	Close();
+	EmuDetach();
+}
+
+int MemoryTransport::Enumerate(char paths[][MAX_STR], int max_devices)
+{
+	int count = EmuGetDeviceCount();
+	if(count > max_devices)
+		count = max_devices;
+	for(int i = 0; i < count; i++)
+		snprintf(paths[i], MAX_STR, MEMORY_PATH_PREFIX "%i", i);
+	return count;
+}
+
+bool MemoryTransport::Open(const char *path)
+{
+	int index = 0;
+
+	if(path){
+		if(strncmp(path, MEMORY_PATH_PREFIX, strlen(MEMORY_PATH_PREFIX)))
+			return false;
+		index = atoi(path + strlen(MEMORY_PATH_PREFIX));
+	}
+	this->emu = EmuGetDevice(index);
+	if(this->emu)
+		snprintf(this->path, sizeof(this->path), MEMORY_PATH_PREFIX "%i", index);
+	return this->emu != NULL;
+}
+
+void MemoryTransport::Close()
+{
+	this->emu = NULL;
+}
+
+bool MemoryTransport::IsOpen()
+{
+	return this->emu != NULL;
+}
+
+int MemoryTransport::Write(const uchar *data, int length)
+{
+	if(this->out_mode == XFER_OUT_FEATURE)
+		return this->emu->WriteFeature(data, length);
+	return this->emu->Write(data, length);
+}
+
+int MemoryTransport::WriteStream(const uchar *reports, int length, int count, int depth)
+{
+	if(this->out_mode == XFER_OUT_FEATURE)
+		return Transport::WriteStream(reports, length, count, depth);
+	return this->emu->WriteBurst(reports, length, count, depth);
+}
+
+bool MemoryTransport::CanQueue()
+{
+	return this->out_mode != XFER_OUT_FEATURE;
+}
+
+int MemoryTransport::GetFeature(uchar *data, int length)
+{
+	int res;
+
+	if(this->in_mode != XFER_IN_INTERRUPT)
+		return this->emu->GetFeature(data, length);
+	res = this->emu->ReadInput(data, length);
+	return res <= 0 ? -1 : res;
+}
+
+bool MemoryTransport::GetManufacturer(wchar_t *str, int maxlen)
+{
+	swprintf(str, maxlen, L"%ls", this->emu->GetManufacturer());
+	return true;
+}
+
+bool MemoryTransport::GetProduct(wchar_t *str, int maxlen)
+{
+	swprintf(str, maxlen, L"%ls", this->emu->GetProduct());
+	return true;
+}
+
+const char *MemoryTransport::GetName()
+{
+	return transport_names[TRANSPORT_MEMORY];
+}
+
+bool MemoryTransport::GetController(char *name, int size)
+{
+	snprintf(name, size, "emulator");
+	return true;
+}
@@ -0,0 +1,157 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include "xbit.h"
+
+// How reports get to the chip and back. hidapi is the default,
+// the others exist to find the lowest latency path per host.
+
+#define TRANSPORT_HID			0	// hidapi: hidraw, IOKit, Windows HID or hidapi's libusb backend
+#define TRANSPORT_LIBUSB		1	// Interrupt OUT and control GET_REPORT issued directly via libusb
+#define TRANSPORT_MEMORY		2	// In-process emulated chip, no USB involved
+#define TRANSPORT_COUNT			3
+
+// Report paths, one per direction. Which ones a host controller handles reliably differs (see NOTES),
+// (c)alibrate measures them and the fastest reliable pair is used from then on
+#define XFER_OUT_REPORT			0	// Output report: interrupt OUT, SET_REPORT Output without one
+#define XFER_OUT_FEATURE		1	// SET_REPORT Feature over the control pipe
+#define XFER_OUT_COUNT			2
+#define XFER_IN_FEATURE			0	// GET_REPORT Feature over the control pipe
+#define XFER_IN_INTERRUPT		1	// Input report from the interrupt IN endpoint
+#define XFER_IN_COUNT			2
+
+extern const char *xfer_out_names[XFER_OUT_COUNT];
+extern const char *xfer_in_names[XFER_IN_COUNT];
+
+#define ST_VENDOR_ID			0x0483
+#define ST_PRODUCT_ID			0x0000
+
+class Transport
+{
+public:
+	Transport();
+	virtual ~Transport() {}
+
+	virtual int Enumerate(char paths[][MAX_STR], int max_devices) = 0;
+	virtual bool Open(const char *path) = 0;		// NULL opens the first chip found
+	virtual void Close() = 0;
+	virtual bool IsOpen() = 0;
+
+	// Both take/return a full REPORT_BUF, report ID byte included
+	virtual int Write(const uchar *data, int length) = 0;
+	virtual int GetFeature(uchar *data, int length) = 0;
+
+	// count reports of length bytes back to back, up to depth of them in flight at once.
+	// Stops at the first failure, returns how many got through. One at a time where there is no async path
+	virtual int WriteStream(const uchar *reports, int length, int count, int depth);
+	// WriteStream really queues them. Without, reports are better sent one by one with the pacing in between
+	virtual bool CanQueue();
+
+	virtual bool GetManufacturer(wchar_t *str, int maxlen) = 0;
+	virtual bool GetProduct(wchar_t *str, int maxlen) = 0;
+	virtual const char *GetName() = 0;
+	const char *GetPath();			// Of the chip Open found, as Enumerate lists it. Empty before
+
+	// Host USB controller the chip hangs off, e.g. "0000:00:14.0". false if it cannot be told
+	virtual bool GetController(char *name, int size);
+
+	// false if this transport has no such path, the old pair stays then
+	virtual bool SetModes(int out_mode, int in_mode);
+	int GetOutMode();
+	int GetInMode();
+
+	static Transport *Create(int type);
+	static int ParseType(const char *name);
+
+protected:
+	int out_mode;
+	int in_mode;
+	char path[MAX_STR];
+};
+
+class HidTransport : public Transport
+{
+public:
+	HidTransport();
+	~HidTransport();
+
+	int Enumerate(char paths[][MAX_STR], int max_devices);
+	bool Open(const char *path);
+	void Close();
+	bool IsOpen();
+	int Write(const uchar *data, int length);
+	int GetFeature(uchar *data, int length);
+	bool GetManufacturer(wchar_t *str, int maxlen);
+	bool GetProduct(wchar_t *str, int maxlen);
+	const char *GetName();
+	bool GetController(char *name, int size);
+
+private:
+	static int instances;
+	hid_device *handle;
+};
+
+#ifdef HAVE_LIBUSB
+struct libusb_context;
+struct libusb_device_handle;
+
+class LibusbTransport : public Transport
+{
+public:
+	LibusbTransport();
+	~LibusbTransport();
+
+	int Enumerate(char paths[][MAX_STR], int max_devices);
+	bool Open(const char *path);
+	void Close();
+	bool IsOpen();
+	int Write(const uchar *data, int length);
+	int GetFeature(uchar *data, int length);
+	bool GetManufacturer(wchar_t *str, int maxlen);
+	bool GetProduct(wchar_t *str, int maxlen);
+	const char *GetName();
+	bool GetController(char *name, int size);
+	bool SetModes(int out_mode, int in_mode);
+	int WriteStream(const uchar *reports, int length, int count, int depth);
+	bool CanQueue();
+
+private:
+	libusb_context *context;	// Own one, so events of one chip are only ever handled by its thread
+	libusb_device_handle *handle;
+	int bus;
+	int interface_number;
+	uchar ep_out;				// 0 if the chip has no interrupt OUT endpoint
+	uchar ep_in;				// 0 if the chip has no interrupt IN endpoint
+	uchar iManufacturer;
+	uchar iProduct;
+
+	bool GetString(uchar index, wchar_t *str, int maxlen);
+};
+#endif
+
+class XbitEmulator;
+
+class MemoryTransport : public Transport
+{
+public:
+	MemoryTransport();
+	~MemoryTransport();
+
+	int Enumerate(char paths[][MAX_STR], int max_devices);
+	bool Open(const char *path);
+	void Close();
+	bool IsOpen();
+	int Write(const uchar *data, int length);
+	int GetFeature(uchar *data, int length);
+	int WriteStream(const uchar *reports, int length, int count, int depth);
+	bool CanQueue();
+	bool GetManufacturer(wchar_t *str, int maxlen);
+	bool GetProduct(wchar_t *str, int maxlen);
+	const char *GetName();
+	bool GetController(char *name, int size);
+
+private:
+	XbitEmulator *emu;
+};
+
+#endif
@@ -0,0 +1,1770 @@
+/*********************************************************************************************************
+ * X-Bit (Xbit) Modchip Flasher (XBIT v1.0)
+ *********************************************************************************************************/
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "xbit.h"
+#include "transport.h"
+
+/////////////////// Macros
+#define min(x,y) (((x)<(y))?(x):(y))
+
+// For converting 8051 big endian to x86 little endian format   
+#define SWAP_UINT16(x) ((((x)&0xff00)>>8) | (((x)&0x00ff)<<8))   
+#define SWAP_UINT32(x) ((((x)&0xff000000)>>24) | (((x)&0x00ff0000)>>8) | (((x)&0x0000ff00)<<8) | (((x)&0x000000ff)<<24)) 
+
+/////////////////// Constants
+
+#define INPUT_REPORT_SIZE	64
+#define STATUS_WIDTH		79
+
+////////////////// Log helper
+// Prefix for every line logged by the current thread, tells devices apart in fleet mode
+static thread_local char log_prefix[32];
+static FILE *log_file = stdout;
+static std::atomic<bool> status_shown(false);	// The status line may come from another thread than the log
+
+// NULL silences the log, e.g. while benchmarking
+void log_set_output(FILE *file)
+{
+	log_file = file;
+}
+
+void log_set_prefix(const char *prefix)
+{
+	snprintf(log_prefix, sizeof(log_prefix), "%s", prefix);
+}
+
+const char *log_get_prefix()
+{
+	return log_prefix;
+}
+
+void log_printf(const char *fmt, ...)
+{
+	char line[512];
+	int len;
+	va_list args;
+
+	if(!log_file)
+		return;
+	// Wipe the status line, it gets redrawn below with the next update
+	if(status_shown.exchange(false))
+		fprintf(stderr, "\r%*s\r", STATUS_WIDTH, "");
+	len = snprintf(line, sizeof(line), "%s", log_prefix);
+	va_start(args, fmt);
+	vsnprintf(line + len, sizeof(line) - len, fmt, args);
+	va_end(args);
+
+	// One call per line, so lines of parallel jobs don't get mixed up
+	fputs(line, log_file);
+}
+
+// Status line redrawn in place on stderr, final leaves it standing
+void log_status(const char *line, bool final)
+{
+	// Pad over what the previous, longer line left behind
+	fprintf(stderr, "\r%-*s%s", STATUS_WIDTH, line, final ? "\n" : "");
+	fflush(stderr);
+	status_shown = !final;
+}
+
+////////////////// Time helper
+unsigned long long get_time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+///////////////// Report pacing
+ReportPacer::ReportPacer()
+{
+	this->start_us = PACING_START_US;
+	Reset();
+}
+
+void ReportPacer::Reset()
+{
+	this->delay_us = this->start_us;
+	this->floor_us = PACING_MIN_US;
+	this->failures = 0;
+	this->confirmed = 0;
+	this->reports = 0;
+	this->payload_bytes = 0;
+	this->first_us = 0;
+	this->last_us = 0;
+}
+
+void ReportPacer::SetStart(int delay_us)
+{
+	this->start_us = delay_us;
+	Reset();
+}
+
+void ReportPacer::Wait()
+{
+	usleep(this->delay_us);
+}
+
+int ReportPacer::GetDelay()
+{
+	return this->delay_us;
+}
+
+int ReportPacer::GetFailures()
+{
+	return this->failures;
+}
+
+int ReportPacer::GetConfirmed()
+{
+	return this->confirmed;
+}
+
+unsigned long ReportPacer::GetReports()
+{
+	return this->reports;
+}
+
+int ReportPacer::GetThroughput()
+{
+	unsigned long long us = this->last_us - this->first_us;
+	return us ? (int)(this->payload_bytes * 1000000ULL / us) : 0;
+}
+
+void ReportPacer::ReportSent(int payload_bytes)
+{
+	this->last_us = get_time_us();
+	if(!this->reports)
+		this->first_us = this->last_us;
+	this->reports++;
+	this->payload_bytes += payload_bytes;
+}
+
+void ReportPacer::BackOff()
+{
+	// Whatever we were running at was too fast, don't come back here
+	this->failures++;
+	this->floor_us = min(this->delay_us + this->delay_us / 2, PACING_START_US);
+	this->delay_us = min(this->delay_us * 2, PACING_MAX_US);
+}
+
+void ReportPacer::ReportFailed()
+{
+	BackOff();
+}
+
+void ReportPacer::SectorGood()
+{
+	// Narrow by a quarter per clean sector, but keep the margin above the last failure
+	int delay = this->delay_us - this->delay_us / 4;
+	this->confirmed++;
+	if(delay < this->floor_us)
+		delay = this->floor_us;
+	this->delay_us = delay;
+}
+
+void ReportPacer::SectorFailed()
+{
+	BackOff();
+}
+
+void ReportPacer::PrintStats()
+{
+	double seconds = (this->last_us - this->first_us) / 1000000.0;
+	log_printf("Pacing: settled at %i us/report, %i failure(s)\n", this->delay_us, this->failures);
+	if(seconds > 0)
+		log_printf("Pacing: %lu bytes in %lu reports, %.1f KB/s\n",
+			this->payload_bytes, this->reports, this->payload_bytes / seconds / 1024);
+}
+
+///////////////// Retry policy
+RetryPolicy::RetryPolicy()
+{
+	this->max_attempts = 8;
+	this->erase_after = 3;
+	this->bus_after = 4;
+	this->reopen_after = 6;
+	this->base_delay_us = 10000;
+	this->max_delay_us = 1000000;
+	this->jitter_percent = 25;
+	// Policies created at the same time still go apart
+	this->jitter.seed((unsigned)(get_time_us() ^ (uintptr_t)this));
+}
+
+int RetryPolicy::GetAction(int failures)
+{
+	if(failures > this->max_attempts)
+		return RETRY_GIVE_UP;
+	if(failures >= this->reopen_after)
+		return RETRY_REOPEN;
+	if(failures >= this->bus_after)
+		return RETRY_BUS;
+	if(failures >= this->erase_after)
+		return RETRY_ERASE;
+	return RETRY_SAME;
+}
+
+int RetryPolicy::GetDelay(int failures)
+{
+	// Exponential backoff, with jitter so several chips on one hub don't retry in lockstep
+	int delay = this->base_delay_us;
+	for(int i = 1; i < failures && delay < this->max_delay_us; i++)
+		delay *= 2;
+	delay = min(delay, this->max_delay_us);
+	return delay + this->jitter() % (delay * this->jitter_percent / 100 + 1);
+}
+
+///////////////// Class
+XbitFlasher::XbitFlasher()
+{
+	this->transport = Transport::Create(TRANSPORT_HID);
+	this->device_initialized = false;
+	this->device_path[0] = 0;
+	this->cache_checked = false;
+	this->checksum_reported = false;
+	this->poll_interval_us = POLL_INTERVAL_US;
+	this->erase_timeout_ms = ERASE_TIMEOUT_MS;
+	this->command_timeout_ms = COMMAND_TIMEOUT_MS;
+	this->diff_mode = false;
+	this->blank_check = false;
+	this->verify_mode = false;
+	this->verify_fail_fast = false;
+	this->bus_session = false;
+	this->io_stats = NULL;
+	this->trace_verbose = false;
+	this->trace_file = NULL;
+	this->chunk_size = MAX_SECTOR_SIZE;
+	this->use_profile = true;
+	this->queue_depth = 1;
+	this->stream_depth = 1;
+	this->use_pipeline = true;
+	this->profile_file[0] = 0;
+	ProfileDefaults(&this->profile);
+	TraceDecoderInit(&this->trace_decoder);
+	memset(this->retry_stats, 0, sizeof(this->retry_stats));
+	memset(this->block_state, BLOCK_UNKNOWN, sizeof(this->block_state));
+	memset(this->block_confirmed, 0, sizeof(this->block_confirmed));
+}
+
+XbitFlasher::~XbitFlasher()
+{
+	delete this->transport;
+}
+
+bool XbitFlasher::SetTransport(int type)
+{
+	Transport *transport;
+
+	if(this->transport->IsOpen())
+		return false;
+	transport = Transport::Create(type);
+	if(!transport)
+		return false;
+	delete this->transport;
+	this->transport = transport;
+	return true;
+}
+
+int XbitFlasher::EnumerateDevices(char paths[][MAX_STR], int max_devices)
+{
+	return this->transport->Enumerate(paths, max_devices);
+}
+
+bool XbitFlasher::OpenDevice(const char *path)
+{
+	int res;
+	wchar_t wstr[MAX_STR];
+
+	// Remember the path, reopening has to get the same chip back
+	if(path)
+		snprintf(this->device_path, sizeof(this->device_path), "%s", path);
+
+	res = this->transport->Open(this->device_path[0] ? this->device_path : NULL);
+	if(!res){
+		log_printf("ERROR: Failed to open %s device!\n", this->transport->GetName());
+		return false;
+	}
+	// Without a path the transport picked a chip, cache and profile go by the one it picked
+	if(this->transport->GetPath()[0])
+		snprintf(this->device_path, sizeof(this->device_path), "%s", this->transport->GetPath());
+
+	res = this->transport->GetManufacturer(wstr, MAX_STR);
+	if(!res || wcsncmp(wstr, DEVICE_MFG, wcslen(DEVICE_MFG))){
+		log_printf("ERROR: Invalid manufacturer string: %ls\n", wstr);
+		CloseDevice();
+		return false;
+	}
+
+	// Product String: DK3200 Evaluation Board
+	res = this->transport->GetProduct(wstr, MAX_STR);
+	if(!res || wcsncmp(wstr, DEVICE_PRODUCT, wcslen(DEVICE_PRODUCT))){
+		log_printf("ERROR: Invalid product string: %ls\n", wstr);
+		CloseDevice();
+		return false;
+	}
+
+	if(!GetStatus()){
+		log_printf("ERROR: Failed to initially get status from modchip. Please retry\n");
+		return false;
+	}
+	this->memory_layout_id = GetMemoryLayout();
+	memset(this->block_state, BLOCK_UNKNOWN, sizeof(this->block_state));
+	memset(this->block_confirmed, 0, sizeof(this->block_confirmed));
+	this->cache.Load(this->transport->GetName(), this->device_path, this->memory_layout_id);
+	LoadProfile();
+	this->cache_checked = false;
+	this->device_initialized = true;
+	return true;
+}
+
+bool XbitFlasher::CloseDevice()
+{
+	this->cache.Save();
+	Reset();
+	this->transport->Close();
+	this->device_initialized = false;
+	return true;
+}
+
+bool XbitFlasher::Reopen()
+{
+	CloseDevice();
+	if(!OpenDevice(NULL))
+		return false;
+	return SetVM(1);
+}
+
+int XbitFlasher::Recover(int block, int phase, int failures)
+{
+	static const char *phase_names[RETRY_PHASE_COUNT] = {"erase", "write", "verify", "read"};
+	int action = this->retry.GetAction(failures);
+
+	if(action == RETRY_GIVE_UP){
+		log_printf("Giving up on block %i: %s failed %i times\n", block, phase_names[phase], failures);
+		return action;
+	}
+
+	this->retry_stats[block][phase]++;
+	this->progress.Retry();
+	usleep(this->retry.GetDelay(failures));
+
+	switch(action){
+		case RETRY_BUS:
+			log_printf("Block %i: %s failed, re-acquiring bus\n", block, phase_names[phase]);
+			SetVM(0);
+			if(!SetVM(1))
+				log_printf("Failed to get bus\n");
+			break;
+		case RETRY_REOPEN:
+			log_printf("Block %i: %s failed, reopening device\n", block, phase_names[phase]);
+			if(!Reopen())
+				log_printf("Failed to reopen device\n");
+			break;
+		default:
+			log_printf("Block %i: %s failed, retrying (%i)\n", block, phase_names[phase], failures);
+			break;
+	}
+	return action;
+}
+
+void XbitFlasher::PrintRetryStats()
+{
+	for(int block = 0; block < TOTAL_BLOCKS; block++){
+		uchar *stats = this->retry_stats[block];
+		if(!stats[RETRY_PHASE_ERASE] && !stats[RETRY_PHASE_WRITE] && !stats[RETRY_PHASE_VERIFY] && !stats[RETRY_PHASE_READ])
+			continue;
+		log_printf("Retries block %2i: erase %i, write %i, verify %i, read %i\n", block,
+			stats[RETRY_PHASE_ERASE], stats[RETRY_PHASE_WRITE], stats[RETRY_PHASE_VERIFY], stats[RETRY_PHASE_READ]);
+	}
+}
+
+Transport *XbitFlasher::GetTransport()
+{
+	return this->transport;
+}
+
+bool XbitFlasher::IsDeviceInitialized()
+{
+	return this->device_initialized;
+}
+
+bool XbitFlasher::IsValidStatus()
+{
+	return (this->statusBuf.reportID == 0 && this->statusBuf.report.u.status.cmd == CMD_GET_STATUS);
+}
+
+uchar XbitFlasher::GetCurrentCommand()
+{
+	return this->statusBuf.report.u.status.currentCmd;
+}
+
+uchar XbitFlasher::GetMemoryLayout()
+{
+	return this->statusBuf.report.u.status.page;
+}
+
+uchar XbitFlasher::GetVMState()
+{
+	return this->statusBuf.report.u.status.vm;
+}
+
+bool XbitFlasher::IsDeviceReady()
+{
+	return (GetCurrentCommand() == 0);
+}
+
+bool XbitFlasher::IsDeviceBusFree()
+{
+	return ((GetVMState() & STATUS_BUS_FREE) == STATUS_BUS_FREE);
+}
+
+bool XbitFlasher::IsDeviceBusAttached()
+{
+	return ((GetVMState() & STATUS_BUS_ATTACHED) == STATUS_BUS_ATTACHED);
+}
+
+bool XbitFlasher::IsDeviceWriteprotected()
+{
+	return ((GetVMState() & STATUS_WRITE_PROTECT) == STATUS_WRITE_PROTECT);
+}
+
+int XbitFlasher::InternalRead(PREPORT_BUF output)
+{
+	int res;
+	unsigned long long start;
+	if(!this->transport->IsOpen())
+		return -1;
+	start = get_time_us();
+	res = this->transport->GetFeature((unsigned char*)output, sizeof(REPORT_BUF));
+	if(this->io_stats && res == sizeof(REPORT_BUF)){
+		this->io_stats->read_us.push_back(get_time_us() - start);
+		this->io_stats->read_bytes += res;
+	}
+	TraceReport(TRACE_IN, output, res, start);
+	return res;
+}
+
+void XbitFlasher::TraceReport(uchar dir, PREPORT_BUF report, int result, unsigned long long time_us)
+{
+	char line[512];
+	const TRACE_RECORD *record = this->trace.Record(dir, report, result, time_us);
+	if(this->trace_verbose){
+		TraceDecode(&this->trace_decoder, record, line, sizeof(line));
+		log_printf("%s\n", line);
+	}
+}
+
+int XbitFlasher::InternalWrite(PREPORT_BUF input)
+{
+	int res;
+	unsigned long long start;
+	if(!this->transport->IsOpen())
+		return -1;
+	start = get_time_us();
+	res = this->transport->Write((unsigned char*)input, sizeof(REPORT_BUF));
+	// Pacing delay is not part of the report latency
+	if(this->io_stats && res == sizeof(REPORT_BUF)){
+		this->io_stats->write_us.push_back(get_time_us() - start);
+		this->io_stats->write_bytes += res;
+	}
+	TraceReport(TRACE_OUT, input, res, start);
+	if(res != sizeof(REPORT_BUF))
+		this->pacer.ReportFailed();
+	this->pacer.Wait();
+	return res;
+}
+
+// All data reports of a CMD_WRITE handed over at once, stream_depth of them in flight.
+// Pacing applies between commands only, the queue keeps the reports back to back
+bool XbitFlasher::InternalWriteStream(WRITE_FRAMES *frames)
+{
+	PREPORT_BUF reports = &frames->reports[1];
+	int count = frames->count - 1, sent;
+	unsigned long long start;
+
+	if(!this->transport->IsOpen())
+		return false;
+	start = get_time_us();
+	sent = this->transport->WriteStream((const uchar *)reports, sizeof(REPORT_BUF), count, this->stream_depth);
+	// One latency sample per report, the stream cost spread over what went through
+	if(this->io_stats && sent > 0){
+		for(int i = 0; i < sent; i++)
+			this->io_stats->write_us.push_back((get_time_us() - start) / sent);
+		this->io_stats->write_bytes += sent * sizeof(REPORT_BUF);
+	}
+	for(int i = 0; i < count && i <= sent; i++)
+		TraceReport(TRACE_OUT, &reports[i], i < sent ? (int)sizeof(REPORT_BUF) : -1, start);
+	for(int i = 0; i < sent; i++)
+		this->pacer.ReportSent(min(frames->nBytes - i * (CMD_SIZE - 1), CMD_SIZE - 1));
+	if(sent != count){
+		this->pacer.ReportFailed();
+		return false;
+	}
+	this->progress.Advance(PROGRESS_OUT, frames->nBytes);
+	this->pacer.Wait();
+	return true;
+}
+
+bool XbitFlasher::GetStatus()
+{
+    REPORT_BUF reportBuf;   
+    memset(&reportBuf, 0, sizeof(REPORT_BUF));   
+   
+    // Send command
+
+    reportBuf.reportID     = 0;   
+    reportBuf.report.u.cmd = CMD_GET_STATUS; 
+
+	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
+		log_printf("Error sending CMD_STATUS command.\n");
+		return false;
+	}
+
+	memset(&statusBuf, 0x00, sizeof(REPORT_BUF));
+	if(InternalRead(&statusBuf) != sizeof(REPORT_BUF)){
+		log_printf("Error reading CMD_GET_STATUS reply.\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool XbitFlasher::WaitForCommand(uchar cmd, int timeout_ms)
+{
+	unsigned long long deadline = get_time_us() + (unsigned long long)timeout_ms * 1000;
+
+	// Poll until the MCU reports the wanted command as the one being processed
+	for(;;){
+		if(GetStatus() && IsValidStatus() && GetCurrentCommand() == cmd)
+			return true;
+		if(get_time_us() >= deadline)
+			return false;
+		usleep(this->poll_interval_us);
+	}
+}
+
+bool XbitFlasher::WaitForCompletion(int timeout_ms)
+{
+	// No active command means the chip is done
+	if(!WaitForCommand(0, timeout_ms)){
+		log_printf("Timeout: modchip still busy with command %02X after %i ms\n", GetCurrentCommand(), timeout_ms);
+		return false;
+	}
+	// Done is not the same as done right, a refused or failed flash routine says so here
+	if(this->statusBuf.report.u.status.ret != STATUS_RET_OK){
+		log_printf("Modchip reported error %02X\n", this->statusBuf.report.u.status.ret);
+		return false;
+	}
+	return true;
+}
+
+bool XbitFlasher::Reset()
+{
+   REPORT_BUF reportBuf;   
+   memset(&reportBuf, 0, sizeof(REPORT_BUF));   
+   
+   // Send command
+
+   reportBuf.reportID     = 0;   
+   reportBuf.report.u.cmd = CMD_RESET; 
+
+	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
+		log_printf("Error sending CMD_RESET command.\n");  
+		return false;
+	}
+
+	return true;
+}
+
+bool XbitFlasher::SetVM(uchar vm)
+{
+	REPORT_BUF reportBuf;   
+	memset(&reportBuf, 0, sizeof(REPORT_BUF));   
+   
+    // Send command
+
+    reportBuf.reportID             = 0;   
+    reportBuf.report.u.setRegs.cmd = CMD_SET_VM;   
+    reportBuf.report.u.setRegs.vm  = vm;  
+
+	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
+		log_printf("Error sending CMD_SET_VM command.\n");  
+		return false;
+	}
+
+	return true;
+}
+
+bool XbitFlasher::GetBus()
+{
+	// Inside a session the bus is already ours, don't hand it back in between
+	if(this->bus_session)
+		return true;
+	if(!this->SetVM(1))
+		return false;
+	CheckCache();
+	return true;
+}
+
+bool XbitFlasher::ReleaseBus()
+{
+	if(this->bus_session)
+		return true;
+	return this->SetVM(0);
+}
+
+// Keeps the bus across several bank operations, e.g. a manifest
+bool XbitFlasher::BeginSession()
+{
+	if(!GetBus())
+		return false;
+	this->bus_session = true;
+	return true;
+}
+
+bool XbitFlasher::EndSession()
+{
+	this->bus_session = false;
+	return ReleaseBus();
+}
+
+bool XbitFlasher::SetPage(int layout_id)
+{
+    REPORT_BUF reportBuf;   
+    memset(&reportBuf, 0, sizeof(REPORT_BUF));
+
+    // Send command
+
+    reportBuf.reportID              = 0;   
+    reportBuf.report.u.setRegs.cmd  = CMD_SET_PAGE;   
+    reportBuf.report.u.setRegs.page = layout_id & 0xFF;
+
+	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
+		log_printf("Error sending CMD_SET_PAGE command.\n");
+		return false;
+	}
+
+	if(!WaitForCompletion(this->command_timeout_ms))
+		return false;
+	this->cache.SetLayout(layout_id);
+	return true;
+}
+
+bool XbitFlasher::ReadFlash(uchar flash, uchar sector, uint16 offset, uchar *buffer, uint16 nBytes)
+{
+    REPORT_BUF reportBuf;   
+    memset(&reportBuf, 0, sizeof(REPORT_BUF));   
+   
+    if (!nBytes)   
+    {   
+        log_printf("Invalid count of bytes to read.\n");   
+        return false;   
+    }   
+   
+   	// Original DK3200 way:
+    // Convert sector offset to xdata address
+    //uint16 address = OffsetToAddress(flash, sector, offset);
+    
+    // XBIT way:
+    // The "address"-field is relative to sector, e.g. it defines address INSIDE the sector
+    // The "flash" field sets the sector
+   
+    // Send command   
+   
+    reportBuf.reportID            = 0;   
+    reportBuf.report.u.cmd        = CMD_READ;   
+    //reportBuf.report.u.rw.flash   = flash;
+    //reportBuf.report.u.rw.address = SWAP_UINT16(address); 
+    reportBuf.report.u.rw.flash   = sector;
+    reportBuf.report.u.rw.address = SWAP_UINT16(offset);  
+    reportBuf.report.u.rw.nBytes  = SWAP_UINT16(nBytes);    
+   
+	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF))
+    {   
+        log_printf("ERROR: Error sending CMD_READ command.\n");    
+        return false;   
+    }   
+   
+    // Read data   
+   
+    uint16 cbRemaining = nBytes;   
+    while (cbRemaining)   
+    {   
+        if (InternalRead(&reportBuf) != sizeof(REPORT_BUF))   
+        {   
+            log_printf("ERROR: Error reading CMD_READ reply.\n");   
+            return false;   
+        }
+   
+        // Skip 0 command byte at start of report buffer   
+   
+        uint16 cbData = min(cbRemaining, CMD_SIZE - 1);   
+        memcpy(buffer, reportBuf.report.u.buffer + 1, cbData);   
+        buffer += cbData;   
+        cbRemaining -= cbData;   
+        this->progress.Advance(PROGRESS_IN, cbData);
+    }
+   
+    return true;   
+}
+
+
+// The CMD_WRITE and its data reports, everything that can be done before touching the wire
+void BuildWriteFrames(WRITE_FRAMES *frames, int block, uint16 offset, const uchar *buffer, uint16 nBytes)
+{
+    PREPORT_BUF reportBuf = &frames->reports[0];
+
+    frames->block = block;
+    frames->offset = offset;
+    frames->nBytes = nBytes;
+    frames->send = true;
+    frames->last = false;
+
+    // Calculate checksum   
+
+    frames->checksum = sum8(buffer, nBytes);
+    frames->blank = is_blank(buffer, nBytes);
+   
+   	// Original DK3200 way:
+    // Convert sector offset to xdata address
+    //uint16 address = OffsetToAddress(flash, sector, offset);
+    
+    // XBIT way:
+    // The "address"-field is relative to sector, e.g. it defines address INSIDE the sector
+    // The "flash" field sets the sector
+
+    memset(reportBuf, 0, sizeof(REPORT_BUF));   
+    reportBuf->reportID            = 0;   
+    reportBuf->report.u.cmd        = CMD_WRITE;   
+    //reportBuf->report.u.rw.flash   = flash;
+    //reportBuf->report.u.rw.address = SWAP_UINT16(address);
+    reportBuf->report.u.rw.flash   = block;
+    reportBuf->report.u.rw.address = SWAP_UINT16(offset);
+    reportBuf->report.u.rw.nBytes  = SWAP_UINT16(nBytes);   
+
+    // Data reports
+   
+    frames->count = 1;
+    for (int done = 0; done < nBytes; done += CMD_SIZE - 1)
+    {
+        reportBuf = &frames->reports[frames->count++];
+        memset(reportBuf, 0, sizeof(REPORT_BUF));
+        memcpy(reportBuf->report.u.buffer + 1, &buffer[done], min(nBytes - done, CMD_SIZE - 1));
+    }
+}
+
+bool XbitFlasher::WriteFlash(uchar flash, uchar sector, uint16 offset, const uchar *buffer, uint16 nBytes)
+{
+    if (!nBytes)   
+    {   
+        log_printf("Invalid count of bytes to write.\n");   
+        return false;   
+    }   
+
+    BuildWriteFrames(&this->write_frames, sector, offset, buffer, nBytes);
+    return SendFrames(&this->write_frames);
+}
+
+bool XbitFlasher::SendFrames(WRITE_FRAMES *frames)
+{
+    int block = frames->block;
+    bool stream = this->stream_depth > 1 && this->transport->CanQueue();
+    uchar reported;
+
+    // Send command   
+   
+    // Whatever the cache knew about the block is gone from here on
+    if (block < TOTAL_BLOCKS)
+        this->cache.Invalidate(block);
+    if(InternalWrite(&frames->reports[0]) != sizeof(REPORT_BUF))
+    {   
+        log_printf("Error sending CMD_WRITE command.\n");     
+        return false;   
+    }
+    if (block < TOTAL_BLOCKS && !frames->blank)
+        this->block_state[block] = BLOCK_PROGRAMMED;
+    // Write data   
+
+    if (stream && !InternalWriteStream(frames))
+    {
+        log_printf("Error writing data.\n");
+        return false;
+    }
+    for (int i = 1; i < frames->count && !stream; i++)
+    {   
+        uint16 cbData = min(frames->nBytes - (i - 1) * (CMD_SIZE - 1), CMD_SIZE - 1);   
+   
+        if (InternalWrite(&frames->reports[i]) != sizeof(REPORT_BUF))
+        {   
+            log_printf("Error writing data.\n");     
+            return false;   
+        }
+        this->pacer.ReportSent(cbData);
+        this->progress.Advance(PROGRESS_OUT, cbData);
+    }   
+   
+    // Verify check sum   
+   
+    if (!WaitForCompletion(this->command_timeout_ms))
+    {
+        this->pacer.SectorFailed();
+        return false;
+    }
+
+    // NOTE: Seems like XBIT does not always report back with checksum?
+    // One that doesn't leaves the field at 0, any other value means it does
+    reported = this->statusBuf.report.u.status.checkSum;
+    if (reported)
+        this->checksum_reported = true;
+    if (block < TOTAL_BLOCKS && (reported != frames->checksum || !this->checksum_reported))
+        this->block_confirmed[block] = false;
+    if (reported != frames->checksum && this->checksum_reported)
+    { 
+		log_printf("Write operation failed: the checksum calculated from\na readback does not match the checksum for the data written.\n");
+		this->pacer.SectorFailed();
+		return false;
+    }   
+     
+    // Without a checksum nothing says the data arrived yet, the readback narrows then
+    if (this->checksum_reported)
+        this->pacer.SectorGood();
+    return true;
+}
+
+bool XbitFlasher::EraseBlock(int flash, int sector)
+{
+   REPORT_BUF reportBuf;   
+   memset(&reportBuf, 0, sizeof(REPORT_BUF));   
+   
+   // Original DK3200 way:
+   // Convert sector address 0 to xdata address   
+   //uint16 address = OffsetToAddress(flash, sector, 0);
+
+   // XBIT way:
+   // The address field is always 0
+   // Sector is defined by "flash"-byte   
+
+   // Send command   
+   
+   reportBuf.reportID               = 0;   
+   reportBuf.report.u.erase.cmd     = CMD_ERASE;
+   //reportBuf.report.u.erase.address = SWAP_UINT16(address);   
+   //reportBuf.report.u.erase.flash   = (uchar) flash;
+   reportBuf.report.u.erase.address = 0;
+   reportBuf.report.u.erase.flash   = (uchar) sector;
+
+	if(InternalWrite(&reportBuf) != sizeof(REPORT_BUF)){
+		log_printf("Error sending CMD_ERASE command.\n");   
+		return false;
+	}
+
+	if(sector >= 0 && sector < TOTAL_BLOCKS){
+		this->block_state[sector] = BLOCK_UNKNOWN;
+		this->cache.Invalidate(sector);
+	}
+	if(!WaitForCompletion(this->erase_timeout_ms))
+		return false;
+	if(sector >= 0 && sector < TOTAL_BLOCKS){
+		this->block_state[sector] = BLOCK_ERASED;
+		this->block_confirmed[sector] = true;
+		this->cache.StoreBlank(sector);
+	}
+	return true;
+}
+
+bool XbitFlasher::Format(int layout)
+{
+	int res = 0;
+	if(layout < 1 || layout > BANK_LAYOUT_COUNT){
+		log_printf("Invalid layout %i, valid: %i-%i\n", layout, 1, BANK_LAYOUT_COUNT);
+		return false;
+	}
+
+	if(IsDeviceWriteprotected()){
+		log_printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+		return false;
+	}
+
+	res = GetBus();
+	if(!res){
+		log_printf("Failed to get bus\n");
+		return false;
+	}
+
+	this->progress.Start("Formatting", 0, TOTAL_BLOCKS, PROGRESS_BLOCKS);
+	res = EraseBlocks(0, TOTAL_BLOCKS, NULL);
+	if(!res)
+		return false;
+	this->progress.Finish();
+
+	res = SetPage(layout);
+	if(!res){
+		log_printf("Failed to set memory layout, id: %i\n", layout);
+		return false;
+	}
+
+	this->memory_layout_id = layout;
+	res = ReleaseBus();
+	if(!res){
+		log_printf("Failed to release bus\n");
+		return false;
+	}
+
+	log_printf("Format finished!\n");
+	return true;
+}
+
+// Digest of what the cache says is on a block, NULL if the chip has to be asked.
+// The first lookup of a block in a session reads its sample back, bus already taken
+// The X-Bit has no serial number, the samples of all known blocks are what tells this chip apart.
+// Once per open, the first time the bus is ours
+void XbitFlasher::CheckCache()
+{
+	uchar sample[CACHE_SAMPLE];
+
+	if(this->cache_checked)
+		return;
+	this->cache_checked = true;
+	for(int block = 0; block < TOTAL_BLOCKS; block++){
+		if(!this->cache.IsUsable(block) || !this->cache.NeedsCheck(block))
+			continue;
+		// Left to CachedDigest to try again
+		if(!ReadFlash(0, block, BlockCache::SampleOffset(block), sample, CACHE_SAMPLE))
+			continue;
+		if(!this->cache.Check(block, sample)){
+			log_printf("Cache: block %i does not match, another chip on %s? Starting over\n", block, this->device_path);
+			this->cache.Clear(this->memory_layout_id);
+			return;
+		}
+	}
+}
+
+const uchar *XbitFlasher::CachedDigest(int block)
+{
+	uchar sample[CACHE_SAMPLE];
+
+	if(!this->cache.IsUsable(block))
+		return NULL;
+	if(this->cache.NeedsCheck(block)){
+		if(!ReadFlash(0, block, BlockCache::SampleOffset(block), sample, CACHE_SAMPLE))
+			return NULL;
+		if(!this->cache.Check(block, sample)){
+			log_printf("Cache: block %i changed since it was last seen, dropping the cache\n", block);
+			this->cache.Clear(this->memory_layout_id);
+			return NULL;
+		}
+	}
+	return this->cache.GetDigest(block);
+}
+
+bool XbitFlasher::IsBlockErased(int block)
+{
+	uchar buf[BLANK_CHECK_CHUNK];
+	int offset, length;
+
+	if(this->block_state[block] != BLOCK_UNKNOWN || !this->blank_check)
+		return (this->block_state[block] == BLOCK_ERASED);
+
+	if(CachedDigest(block)){
+		this->block_state[block] = this->cache.IsBlank(block) ? BLOCK_ERASED : BLOCK_PROGRAMMED;
+		return (this->block_state[block] == BLOCK_ERASED);
+	}
+
+	// Read in small chunks, programmed blocks usually bail out on the first one
+	for(offset = 0; offset < BLOCK_SIZE; offset += length){
+		length = min(BLANK_CHECK_CHUNK, BLOCK_SIZE - offset);
+		if(!ReadFlash(0, block, offset, buf, length)){
+			log_printf("Blank check of block %i failed, erasing it anyways\n", block);
+			return false;
+		}
+		if(!is_blank(buf, length)){
+			this->block_state[block] = BLOCK_PROGRAMMED;
+			return false;
+		}
+	}
+	this->block_state[block] = BLOCK_ERASED;
+	this->cache.StoreBlank(block);
+	return true;
+}
+
+bool XbitFlasher::EraseBlocks(int start_block, int block_count, const bool *needed)
+{
+	int failures;
+	int skipped = 0;
+	for (int i = 0; i < block_count; i++){
+		if(needed && !needed[i])
+			continue;
+		if(IsBlockErased(start_block + i)){
+			skipped++;
+			this->progress.Advance(PROGRESS_BLOCKS, 1);
+			continue;
+		}
+		failures = 0;
+		while(!EraseBlock(0, start_block + i)){
+			if(Recover(start_block + i, RETRY_PHASE_ERASE, ++failures) == RETRY_GIVE_UP){
+				log_printf("Failed to erase block %i\n", start_block + i);
+				return false;
+			}
+		}
+		this->progress.Advance(PROGRESS_BLOCKS, 1);
+	}
+	if(skipped)
+		log_printf("Blank check: %i block(s) already erased, skipped erase\n", skipped);
+	return true;
+}
+
+bool XbitFlasher::EraseBank(int bank)
+{
+	int res = 0;
+	const BANK_SCHEDULE *schedule = GetSchedule(bank);
+
+	if(!schedule)
+		return false;
+
+	if(IsDeviceWriteprotected()){
+		log_printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+		return false;
+	}
+
+	res = GetBus();
+	if(!res){
+		log_printf("Failed to get bus\n");
+		return false;
+	}
+	this->progress.Start("Erasing", bank, schedule->block_count, PROGRESS_BLOCKS);
+	res = EraseBlocks(schedule->start_block, schedule->block_count, NULL);
+	if(!res)
+		return false;
+	this->progress.Finish();
+
+	res = ReleaseBus();
+	if(!res){
+		log_printf("Failed to release bus\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool XbitFlasher::WriteSector(int block, uint16 offset, const uchar *data, int length, bool erased)
+{
+	int res;
+	int start, end;
+
+	// An erased block already reads 0xFF, so only send the chunks that carry data
+	for(start = 0; start < length; start = end){
+		if(erased){
+			while(start < length && is_blank(&data[start], min(SKIP_CHUNK, length - start))){
+				this->skipped_bytes += min(SKIP_CHUNK, length - start);
+				this->progress.Advance(PROGRESS_OUT, min(SKIP_CHUNK, length - start));
+				start += SKIP_CHUNK;
+			}
+			if(start >= length)
+				break;
+			end = start;
+			while(end < length && !is_blank(&data[end], min(SKIP_CHUNK, length - end)))
+				end += SKIP_CHUNK;
+			end = min(end, length);
+		}
+		else {
+			end = length;
+		}
+
+		// No command bigger than the chunk size, a lost one costs less on a flaky host
+		end = min(end, start + this->chunk_size);
+		res = WriteFlash(0, block, offset + start, &data[start], end - start);
+		if(!res)
+			return false;
+	}
+	return true;
+}
+
+int XbitFlasher::VerifySector(int block, uint16 offset, const uchar *expected, int length)
+{
+	uchar *buf = this->sector_buf;
+
+	if(!ReadFlash(0, block, offset, buf, length)){
+		log_printf("Failed to read back block %i @ 0x%04X\n", block, offset);
+		return VERIFY_ERROR;
+	}
+	return compare_readback(buf, expected, length);
+}
+
+int compare_readback(const uchar *read, const uchar *expected, int length)
+{
+	int res = VERIFY_MATCH;
+
+	for(int i = 0, next; i < length; i++){
+		next = find_diff(&read[i], &expected[i], length - i);
+		if(next < 0)
+			break;
+		i += next;
+		// Writing can only clear bits, anything that has to go back to 1 needs an erase
+		if((read[i] & expected[i]) != expected[i])
+			return VERIFY_ERASE;
+		res = VERIFY_REPROGRAM;
+	}
+	return res;
+}
+
+bool XbitFlasher::WriteBlock(int block, const uchar *data, bool erased)
+{
+	int res;
+	int sector = 0;
+	int failures = 0;
+	int mismatches = 0;
+	bool dirty = !erased;
+	unsigned long progress_base = this->progress.GetDone();
+	SECTOR_RESULT *result;
+
+	// "erased" stays true on rewrites, the 0xFF ranges are still blank on the chip
+	while(sector < SECTORS_PER_BLOCK){
+		result = &this->sector_results[block][sector];
+		if(dirty){
+			// Takes the other sector with it, so start over with the whole block
+			if(!EraseBlock(0, block)){
+				if(Recover(block, RETRY_PHASE_ERASE, ++failures) == RETRY_GIVE_UP){
+					result->status = SECTOR_FAILED;
+					return false;
+				}
+				continue;
+			}
+			dirty = false;
+			erased = true;
+			sector = 0;
+			continue;
+		}
+		this->progress.SetDone(progress_base + sector * MAX_SECTOR_SIZE);
+		res = WriteSector(block, sector * MAX_SECTOR_SIZE, &data[sector * MAX_SECTOR_SIZE], MAX_SECTOR_SIZE, erased);
+		result->writes++;
+		if(!res){
+			if(this->chunk_size / 2 >= CHUNK_MIN)
+				this->chunk_size /= 2;
+			// Queued reports arrive back to back, not every host controller keeps up with that
+			if(this->stream_depth > 1)
+				this->stream_depth /= 2;
+			if(Recover(block, RETRY_PHASE_WRITE, ++failures) == RETRY_GIVE_UP){
+				result->status = SECTOR_FAILED;
+				return false;
+			}
+			// Whatever the failed command got onto the chip stays there, after a lost data report
+			// the rest of it landed shifted. Programming only clears bits, so only an erase undoes that
+			result->erases++;
+			dirty = true;
+			continue;
+		}
+		// Without a checksum from the chip only a readback tells that the sector made it
+		if(!this->verify_mode && this->block_confirmed[block]){
+			result->status = SECTOR_OK;
+			sector++;
+			continue;
+		}
+
+		res = VerifySector(block, sector * MAX_SECTOR_SIZE, &data[sector * MAX_SECTOR_SIZE], MAX_SECTOR_SIZE);
+		if(res == VERIFY_MATCH){
+			if(!this->checksum_reported)
+				this->pacer.SectorGood();
+			result->status = SECTOR_OK;
+			sector++;
+			continue;
+		}
+		if(res == VERIFY_ERROR || ++mismatches > VERIFY_RETRIES){
+			result->status = SECTOR_FAILED;
+			return false;
+		}
+
+		log_printf("Verify of block %i, sector %i failed, retrying\n", block, sector);
+		this->retry_stats[block][RETRY_PHASE_VERIFY]++;
+		this->progress.Retry();
+		if(res == VERIFY_ERASE){
+			result->erases++;
+			dirty = true;
+		}
+	}
+	// Every sector is confirmed by now, by its checksums or by reading it back
+	this->cache.StoreData(block, data);
+	// Try bigger commands and a deeper queue again after a clean block
+	if(!failures && this->chunk_size < MAX_SECTOR_SIZE)
+		this->chunk_size *= 2;
+	if(!failures && this->stream_depth < this->queue_depth)
+		this->stream_depth = min(this->stream_depth * 2, this->queue_depth);
+	return true;
+}
+
+void XbitFlasher::PrintSectorResults(int start_block, int block_count)
+{
+	SECTOR_RESULT *result;
+	int ok = 0, retried = 0, failed = 0;
+
+	log_printf("Sector report:\n");
+	for(int block = start_block; block < start_block + block_count; block++){
+		for(int sector = 0; sector < SECTORS_PER_BLOCK; sector++){
+			result = &this->sector_results[block][sector];
+			if(result->status == SECTOR_UNTOUCHED)
+				continue;
+			log_printf("  Block %2i, sector %i: %s, %i write(s), %i re-erase(s)\n", block, sector,
+				result->status == SECTOR_OK ? "OK    " : "FAILED", result->writes, result->erases);
+			if(result->status == SECTOR_FAILED)
+				failed++;
+			else if(result->writes > 1)
+				retried++;
+			else
+				ok++;
+		}
+	}
+	log_printf("%i sector(s) OK, %i OK after retry, %i failed\n", ok, retried, failed);
+}
+
+bool XbitFlasher::DiffBlocks(int start_block, int block_count, const uchar *input_data, bool *changed)
+{
+	int res;
+	int offset;
+	uchar *buf = this->sector_buf;
+	uchar digest[SHA256_SIZE];
+	const uchar *cached;
+	int cache_hits = 0;
+
+	for(int block = 0; block < block_count; ++block) {
+		changed[block] = false;
+		cached = CachedDigest(start_block + block);
+		if(cached){
+			sha256(&input_data[block * BLOCK_SIZE], BLOCK_SIZE, digest);
+			changed[block] = memcmp(cached, digest, SHA256_SIZE) != 0;
+			if(!changed[block])
+				this->block_state[start_block + block] = this->cache.IsBlank(start_block + block) ? BLOCK_ERASED : BLOCK_PROGRAMMED;
+			this->progress.Advance(PROGRESS_IN, BLOCK_SIZE);
+			cache_hits++;
+			continue;
+		}
+		for(int sector = 0; sector < (BLOCK_SIZE / MAX_SECTOR_SIZE); sector++) {
+			offset = (block * BLOCK_SIZE) + (sector * MAX_SECTOR_SIZE);
+			res = ReadFlash(0, start_block + block, sector * MAX_SECTOR_SIZE, buf, MAX_SECTOR_SIZE);
+			if(!res){
+				log_printf("Failed to read data!\n");
+				return false;
+			}
+			// One differing sector is enough, the whole block gets erased anyways
+			if(find_diff(buf, &input_data[offset], MAX_SECTOR_SIZE) >= 0){
+				changed[block] = true;
+				this->progress.Advance(PROGRESS_IN, (SECTORS_PER_BLOCK - 1 - sector) * MAX_SECTOR_SIZE);
+				break;
+			}
+		}
+		if(!changed[block]){
+			this->block_state[start_block + block] = is_blank(&input_data[block * BLOCK_SIZE], BLOCK_SIZE) ? BLOCK_ERASED : BLOCK_PROGRAMMED;
+			this->cache.StoreData(start_block + block, &input_data[block * BLOCK_SIZE]);
+		}
+	}
+	if(cache_hits)
+		log_printf("Cache: %i of %i blocks compared by digest, not read\n", cache_hits, block_count);
+	return true;
+}
+
+// Diff, erase and write the blocks of a schedule, bus already taken. bank only labels the progress, 0 is the whole chip
+bool XbitFlasher::WriteBlocks(const BANK_SCHEDULE *schedule, const uchar *input_data, int bank)
+{
+	int res = 0;
+	bool changed[TOTAL_BLOCKS];
+	int unchanged = 0;
+	int block;
+	int start_block = schedule->start_block;
+	int block_count = schedule->block_count;
+
+	if(this->diff_mode){
+		this->progress.Start("Comparing", bank, block_count * BLOCK_SIZE, PROGRESS_IN);
+		res = DiffBlocks(start_block, block_count, input_data, changed);
+		if(!res){
+			log_printf("Failed to compare bank with image\n");
+			return false;
+		}
+		this->progress.Finish();
+		for(int block = 0; block < block_count; ++block) {
+			if(!changed[block])
+				unchanged++;
+		}
+	}
+	else {
+		for(int block = 0; block < block_count; ++block)
+			changed[block] = true;
+	}
+
+	this->progress.Start("Erasing", bank, block_count - unchanged, PROGRESS_BLOCKS);
+	res = EraseBlocks(start_block, block_count, changed);
+	if(!res){
+		log_printf("Failed to erase bank\n");
+		return false;
+	}
+	this->progress.Finish();
+
+	this->skipped_bytes = 0;
+	this->stream_depth = this->queue_depth;
+	memset(this->sector_results, 0, sizeof(this->sector_results));
+	this->progress.Start("Writing", bank, (block_count - unchanged) * BLOCK_SIZE, PROGRESS_OUT);
+	// Block by block from where the pipeline stopped, with the full retry ladder
+	block = this->use_pipeline ? WritePipelined(start_block, block_count, input_data, changed) : 0;
+	for(; block < block_count; ++block) {
+		if(!changed[block])
+			continue;
+		res = WriteBlock(start_block + block, &input_data[block * BLOCK_SIZE], this->block_state[start_block + block] == BLOCK_ERASED);
+		if(!res){
+			log_printf("Failed to write block %i\n", start_block + block);
+			if(this->verify_mode)
+				PrintSectorResults(start_block, block_count);
+			PrintRetryStats();
+			return false;
+		}
+	}
+	this->progress.Finish();
+
+	if(this->verify_mode)
+		PrintSectorResults(start_block, block_count);
+	PrintRetryStats();
+
+	if(this->diff_mode)
+		log_printf("Diff: %i of %i blocks unchanged, skipped erase and write\n", unchanged, block_count);
+	if(this->skipped_bytes)
+		log_printf("Skipped sending %i bytes of 0xFF on erased blocks\n", this->skipped_bytes);
+	this->pacer.PrintStats();
+	return true;
+}
+
+bool XbitFlasher::FlashBank(int bank, const uchar *input_data, int data_length)
+{
+	int res = 0;
+	const BANK_SCHEDULE *schedule = GetSchedule(bank);
+
+	if(!schedule)
+		return false;
+	if(schedule->size != data_length){
+		log_printf("BIOS size %i does not match bank size %i\n", data_length, schedule->size);
+		return false;
+	}
+
+	if(IsDeviceWriteprotected()){
+		log_printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+		return false;
+	}
+
+	res = GetBus();
+	if(!res){
+		log_printf("Failed to get bus\n");
+		return false;
+	}
+
+	res = WriteBlocks(schedule, input_data, bank);
+	if(!res)
+		return false;
+
+	res = ReleaseBus();
+	if(!res){
+		log_printf("Failed to release bus\n");
+		return false;
+	}
+	return true;
+}
+
+// Writes all TOTAL_BLOCKS blocks and sets the layout they were dumped with, in one bus session
+bool XbitFlasher::ProgramChip(int layout, const uchar *input_data)
+{
+	int res = 0;
+
+	if(layout < 1 || layout > BANK_LAYOUT_COUNT){
+		log_printf("Invalid layout %i, valid: %i-%i\n", layout, 1, BANK_LAYOUT_COUNT);
+		return false;
+	}
+
+	if(IsDeviceWriteprotected()){
+		log_printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+		return false;
+	}
+
+	res = GetBus();
+	if(!res){
+		log_printf("Failed to get bus\n");
+		return false;
+	}
+
+	res = WriteBlocks(&layout_table.chip, input_data, 0);
+	if(!res)
+		return false;
+
+	res = SetPage(layout);
+	if(!res){
+		log_printf("Failed to set memory layout, id: %i\n", layout);
+		return false;
+	}
+	this->memory_layout_id = layout;
+
+	res = ReleaseBus();
+	if(!res){
+		log_printf("Failed to release bus\n");
+		return false;
+	}
+	return true;
+}
+
+// Reads the transfers of a schedule into sink, bus already taken
+bool XbitFlasher::ReadBlocks(const BANK_SCHEDULE *schedule, SECTOR_SINK sink, void *context, int *num_bytes_read)
+{
+	const TRANSFER *transfer;
+	int failures;
+	bool blank = true;
+	int offset = 0;
+	int sample = 0;
+	SHA256_CTX ctx;
+	uchar digest[SHA256_SIZE];
+	uchar sample_buf[CACHE_SAMPLE];
+
+	*num_bytes_read = 0;
+	for(int i = 0; i < schedule->transfer_count; i++){
+		transfer = &schedule->transfers[i];
+		offset = i * MAX_SECTOR_SIZE;
+		if(transfer->sector == 0){
+			blank = true;
+			sha256_init(&ctx);
+			sample = BlockCache::SampleOffset(transfer->block);
+		}
+		failures = 0;
+		while(!ReadFlash(0, transfer->block, transfer->offset, this->sector_buf, MAX_SECTOR_SIZE)){
+			this->progress.SetDone(offset);
+			if(Recover(transfer->block, RETRY_PHASE_READ, ++failures) == RETRY_GIVE_UP){
+				log_printf("Failed to read data!\n");
+				return false;
+			}
+		}
+		// Hand out whole sectors only, a retried sector never shows up twice
+		if(!sink(context, offset, this->sector_buf, MAX_SECTOR_SIZE))
+			return false;
+		blank = blank && is_blank(this->sector_buf, MAX_SECTOR_SIZE);
+		*num_bytes_read += MAX_SECTOR_SIZE;
+		sha256_update(&ctx, this->sector_buf, MAX_SECTOR_SIZE);
+		if(sample >= transfer->offset && sample < transfer->offset + MAX_SECTOR_SIZE)
+			memcpy(sample_buf, &this->sector_buf[sample - transfer->offset], CACHE_SAMPLE);
+
+		if(transfer->sector == SECTORS_PER_BLOCK - 1){
+			this->block_state[transfer->block] = blank ? BLOCK_ERASED : BLOCK_PROGRAMMED;
+			sha256_final(&ctx, digest);
+			this->cache.Store(transfer->block, digest, sample_buf);
+		}
+	}
+	return true;
+}
+
+bool XbitFlasher::ReadBank(int bank, SECTOR_SINK sink, void *context, int *num_bytes_read)
+{
+	int res;
+	const BANK_SCHEDULE *schedule = GetSchedule(bank);
+
+	if(!schedule)
+		return false;
+
+	if(IsDeviceWriteprotected()){
+		log_printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+		return false;
+	}
+
+	res = GetBus();
+	if(!res){
+		log_printf("Failed to get bus\n");
+		return false;
+	}
+
+	this->progress.Start("Reading", bank, schedule->size, PROGRESS_IN);
+	res = ReadBlocks(schedule, sink, context, num_bytes_read);
+	this->progress.Finish();
+	if(!res){
+		ReleaseBus();
+		return false;
+	}
+	PrintRetryStats();
+
+	res = ReleaseBus();
+	if(!res){
+		log_printf("Failed to release bus\n");
+		return false;
+	}
+	return true;
+}
+
+// All TOTAL_BLOCKS blocks regardless of the layout, in one bus session
+bool XbitFlasher::ReadChip(SECTOR_SINK sink, void *context, int *num_bytes_read)
+{
+	int res;
+
+	if(IsDeviceWriteprotected()){
+		log_printf("Modchip is write-protected?!?! Try resetting it by replugging USB cable..\n");
+		return false;
+	}
+
+	res = GetBus();
+	if(!res){
+		log_printf("Failed to get bus\n");
+		return false;
+	}
+
+	this->progress.Start("Reading", 0, TOTAL_BLOCKS * BLOCK_SIZE, PROGRESS_IN);
+	res = ReadBlocks(&layout_table.chip, sink, context, num_bytes_read);
+	this->progress.Finish();
+	if(!res){
+		ReleaseBus();
+		return false;
+	}
+	PrintRetryStats();
+
+	res = ReleaseBus();
+	if(!res){
+		log_printf("Failed to release bus\n");
+		return false;
+	}
+	return true;
+}
+
+typedef struct
+{
+	const uchar *expected;
+	int start_block;
+	bool fail_fast;
+	int bad_sectors;
+	std::vector<MISMATCH> *mismatches;
+} COMPARE_CONTEXT;
+
+static bool CompareSector(void *context, int offset, const uchar *data, int length)
+{
+	COMPARE_CONTEXT *compare = (COMPARE_CONTEXT *)context;
+	const uchar *expected = &compare->expected[offset];
+	MISMATCH range;
+	int i, last, next;
+
+	i = find_diff(data, expected, length);
+	if(i < 0)
+		return true;
+	compare->bad_sectors++;
+
+	// Collect the differing ranges, bridging short runs of matching bytes
+	range.block = compare->start_block + offset / BLOCK_SIZE;
+	range.sector = (offset % BLOCK_SIZE) / MAX_SECTOR_SIZE;
+	while(i < length){
+		range.offset = i;
+		range.differing = 0;
+		for(last = i; i < length && i - last < MISMATCH_GAP; i++){
+			if(data[i] != expected[i]){
+				last = i;
+				range.differing++;
+			}
+		}
+		range.length = last - range.offset + 1;
+		compare->mismatches->push_back(range);
+		if(i >= length)
+			break;
+		next = find_diff(&data[i], &expected[i], length - i);
+		if(next < 0)
+			break;
+		i += next;
+	}
+	return !compare->fail_fast;
+}
+
+void XbitFlasher::PrintMismatches()
+{
+	bool reflash[TOTAL_BLOCKS];
+	char line[128];
+	int len = 0;
+
+	line[0] = 0;
+	memset(reflash, 0, sizeof(reflash));
+	for(size_t i = 0; i < this->mismatches.size(); i++){
+		MISMATCH *range = &this->mismatches[i];
+		reflash[range->block] = true;
+		if(i < MISMATCH_PRINT_MAX)
+			log_printf("  Block %2i, sector %i @ 0x%04X: %i byte(s), %i differ\n", range->block, range->sector,
+				range->offset, range->length, range->differing);
+	}
+	if(this->mismatches.size() > MISMATCH_PRINT_MAX)
+		log_printf("  ... and %i more range(s)\n", (int)this->mismatches.size() - MISMATCH_PRINT_MAX);
+
+	for(int block = 0; block < TOTAL_BLOCKS; block++){
+		if(reflash[block])
+			len += snprintf(line + len, sizeof(line) - len, " %i", block);
+	}
+	log_printf("Blocks to re-flash:%s\n", line);
+}
+
+bool XbitFlasher::VerifyBank(int bank, const uchar *input_data, int data_length)
+{
+	int res;
+	COMPARE_CONTEXT compare;
+	const BANK_SCHEDULE *schedule = GetSchedule(bank);
+	int bytes_read;
+
+	if(!schedule)
+		return false;
+	if(schedule->size != data_length){
+		log_printf("Passed data length does not match bank size!\n");
+		return false;
+	}
+
+	// Compared as the sectors come in, fail-fast stops reading at the first bad one
+	this->mismatches.clear();
+	compare.expected = input_data;
+	compare.start_block = schedule->start_block;
+	compare.fail_fast = this->verify_fail_fast;
+	compare.bad_sectors = 0;
+	compare.mismatches = &this->mismatches;
+	res = ReadBank(bank, CompareSector, &compare, &bytes_read);
+	if(!res && !compare.bad_sectors){
+		log_printf("Failed to read bank for verification!\n");
+		return false;
+	}
+
+	if(compare.bad_sectors){
+		if(this->verify_fail_fast)
+			log_printf("Verificaton failed: Data mismatch, stopped at the first bad sector\n");
+		else
+			log_printf("Verificaton failed: Data mismatch in %i sector(s)\n", compare.bad_sectors);
+		PrintMismatches();
+		return false;
+	}
+
+	if(bytes_read != schedule->size){
+		log_printf("Did not read enough data from bank for verification\n");
+		return false;
+	}
+	log_printf("Success! Data matches!\n");
+	return true;
+}
+
+static bool DigestSector(void *context, int offset, const uchar *data, int length)
+{
+	DigestsUpdate((IMAGE_DIGESTS *)context, data, length);
+	return true;
+}
+
+// Like VerifyBank, against the block digests of an image instead of the image itself
+bool XbitFlasher::VerifyBankDigests(int bank, const IMAGE_DIGESTS *expected)
+{
+	int res;
+	IMAGE_DIGESTS actual;
+	const BANK_SCHEDULE *schedule = GetSchedule(bank);
+	int bytes_read, bad_blocks = 0;
+	char line[128];
+	int len = 0;
+
+	if(!schedule)
+		return false;
+	if(schedule->size != expected->size){
+		log_printf("Digests cover %i bytes, bank size is %i!\n", expected->size, schedule->size);
+		return false;
+	}
+	if(expected->bank && (expected->layout != this->memory_layout_id || expected->bank != bank))
+		log_printf("Note: digests were taken from layout %i bank %i\n", expected->layout, expected->bank);
+
+	DigestsInit(&actual, this->memory_layout_id, bank);
+	res = ReadBank(bank, DigestSector, &actual, &bytes_read);
+	if(!res || bytes_read != schedule->size){
+		log_printf("Failed to read bank for verification!\n");
+		return false;
+	}
+	DigestsFinal(&actual);
+
+	if(!memcmp(actual.image_sha, expected->image_sha, SHA256_SIZE) && actual.image_crc == expected->image_crc){
+		log_printf("Success! Digests match!\n");
+		return true;
+	}
+
+	line[0] = 0;
+	for(int block = 0; block < schedule->block_count; block++){
+		if(actual.block_crc[block] == expected->block_crc[block]
+			&& !memcmp(actual.block_sha[block], expected->block_sha[block], SHA256_SIZE))
+			continue;
+		bad_blocks++;
+		log_printf("  Block %2i: crc32 %08x, expected %08x\n", schedule->start_block + block, actual.block_crc[block], expected->block_crc[block]);
+		len += snprintf(line + len, sizeof(line) - len, " %i", schedule->start_block + block);
+	}
+	log_printf("Verificaton failed: %i block(s) differ\n", bad_blocks);
+	log_printf("Blocks to re-flash:%s\n", line);
+	return false;
+}
+
+// Schedule of a bank in the current layout, precomputed in layout_table
+const BANK_SCHEDULE *XbitFlasher::GetSchedule(int bank)
+{
+	const BANK_SCHEDULE *schedule = GetBankSchedule(this->memory_layout_id, bank);
+
+	if(!schedule)
+		log_printf("Bank %i does not exist in layout %i\n", bank, this->memory_layout_id);
+	return schedule;
+}
+
+void XbitFlasher::PrintMemoryBankLayout()
+{
+	int size;
+	printf("Memory Bank Configurations:\n");
+	for(int i=1; i <= BANK_LAYOUT_COUNT; i++){
+		printf("Layout %i: ", i);
+		for(int j=1; j <= BANKS_MAX; j++){
+			size = bank_layout[i - 1][j - 1] * 1024;
+			if (!size)
+				continue;
+			printf("Bios#%i [%ibytes] ", j, size / 1024);
+		}
+		printf("\n");
+	}	
+}
+
+void XbitFlasher::PrintBankSelection()
+{
+	int mask;
+	printf("DIP switch positions:\n");
+	printf("          1    2    3\n");
+	for(int i=0; i < BANKS_MAX; i++){
+		mask = bios_select_switches[i];
+		printf("Bios %i: %s - %s - %s\n", i + 1,
+			mask & 1 ? "ON " : "OFF",
+			mask & 2 ? "ON " : "OFF",
+			mask & 4 ? "ON " : "OFF");
+	}
+}
+
+void XbitFlasher::PrintUsage(const char* argv0)
+{
+	printf("X-Bit (Xbit) Modchip Flasher (XBIT v1.0)\n");
+	printf("Usage: %s [mode] [layout] [bank] [filename]\n", argv0);
+	printf("  e.g. %s w 5 3 bios.bin\n", argv0);
+	printf("Modes:\n");
+	printf("(r)ead, (w)rite, (v)erify, (f)ormat\n");
+	printf("(v)erify also takes the %s file that every dump and write leaves next to the image\n", DIGEST_FILE_EXT);
+	printf("(d)ump whole chip, (p)rogram whole chip: %s d chip.img\n", argv0);
+	printf("(m)anifest, several banks in one go: %s m loadout.txt\n", argv0);
+	printf("(c)alibrate: find the fastest reliable report path and pacing for this host, used from then on: %s c\n", argv0);
+	printf("NOTE: To format the chip, only layout param is required\n");
+	printf("Options:\n");
+	printf("--diff         (w)rite: only erase and rewrite blocks that differ from the file\n");
+	printf("--blank-check  (w)rite/(f)ormat: read blocks first, skip erasing blocks that are blank\n");
+	printf("--verify       (w)rite: read back every sector after writing it, retry only failed sectors\n");
+	printf("--fail-fast    (v)erify: stop at the first sector that does not match\n");
+	printf("--retries=<n>  give up on a block after n failures (default: %i)\n", this->retry.max_attempts);
+	printf("--transport=<hid|libusb|mem>  how to talk to the chip (default: hid, mem is an emulated chip)\n");
+	printf("--all          run the job on every attached X-Bit in parallel (reads go to <filename>.<n>)\n");
+	printf("--trace=<file> save the last %i reports to file after the job (default: on failure, to %s)\n", TRACE_RECORDS, TRACE_FILE);
+	printf("--verbose      log every report as it is sent/received\n");
+	printf("--quiet        no progress display, for scripts\n");
+	printf("--strict       don't answer diffs/blank checks from the block cache, read the chip\n");
+	printf("--no-cache     don't load or update the block cache (%s)\n", CACHE_DIR);
+	printf("--no-profile   start with the default report path, pacing and chunk size, don't update the profile\n");
+	printf("--no-pipeline  prepare each write between the USB calls instead of in a second thread\n");
+	printf("--queue-depth=<n>  keep up to n data reports of a write in flight, libusb/mem only (default: 1, max %i)\n", QUEUE_DEPTH_MAX);
+	printf("X-Bit Properties:\n\n");
+	PrintMemoryBankLayout();
+	PrintBankSelection();
+}
@@ -1,7 +1,18 @@
 #ifndef _XBIT_H
 #define _XBIT_H
 
+#include <stdio.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+
+#ifdef XBIT_EMULATOR
+#include "hidemu.h"
+#else
 #include "hidapi/hidapi.h"
+#endif
 
 #define CMD_RESET				0x01
 #define CMD_ERASE				0x02
@@ -23,18 +34,110 @@
 #define STATUS_BUS_FREE			0x01
 #define STATUS_BUS_ATTACHED		0x02
 #define STATUS_WRITE_PROTECT	0x80
+#define STATUS_RET_OK			0x00 // status.ret of a flash routine that went through
 
 #define TOTAL_BLOCKS			0x20 // 32
 #define BLOCK_SIZE				0x10000 // 64 kbytes
+#define MAX_SECTOR_SIZE			0x8000 // half block
+#define SECTORS_PER_BLOCK		(BLOCK_SIZE / MAX_SECTOR_SIZE)
+
+// What we know about a block in the current session
+#define BLOCK_UNKNOWN			0
+#define BLOCK_ERASED			1
+#define BLOCK_PROGRAMMED		2
+
+#define BLANK_CHECK_CHUNK		((CMD_SIZE - 1) * 64) // Bytes per read while blank checking
+
+#define SKIP_CHUNK				0x400 // Granularity for not sending 0xFF ranges of a sector
+#define CHUNK_MIN				SKIP_CHUNK // Smallest CMD_WRITE the chunk size gets halved to on failures
+
+// Outcome of an inline sector verify
+#define VERIFY_MATCH			0
+#define VERIFY_REPROGRAM		1	// Mismatch, but only bits that a write can still clear
+#define VERIFY_ERASE			2	// Mismatch that needs the block erased again
+#define VERIFY_ERROR			3
+
+#define VERIFY_RETRIES			3
+
+#define MISMATCH_GAP			16	// Differing bytes closer than this are reported as one range
+#define MISMATCH_PRINT_MAX		32
+
+#define SECTOR_UNTOUCHED		0
+#define SECTOR_OK				1
+#define SECTOR_FAILED			2
+
+// Retry escalation ladder
+#define RETRY_SAME				0	// Just try again
+#define RETRY_ERASE				1	// Erase the block again, then rewrite it
+#define RETRY_BUS				2	// Release and re-acquire the bus
+#define RETRY_REOPEN			3	// Close and reopen the device
+#define RETRY_GIVE_UP			4
+
+#define RETRY_PHASE_ERASE		0
+#define RETRY_PHASE_WRITE		1
+#define RETRY_PHASE_VERIFY		2
+#define RETRY_PHASE_READ		3
+#define RETRY_PHASE_COUNT		4
+
+#define MAX_STR					255
 
 #define DEVICE_MFG 				L"ST Microelectronics"
 #define DEVICE_PRODUCT 			L"DK3200 Evaluation Board"
 
+// Delay after each output report, in microseconds.
+// Start value is the delay that was known to work on flaky host controllers (see NOTES)
+#define PACING_START_US			8000
+#define PACING_MIN_US			250
+#define PACING_MAX_US			32000
+
+// Data reports of a CMD_WRITE in flight at once with --queue-depth, 1 sends them one by one
+#define QUEUE_DEPTH_MAX			64
+#define STREAM_REPORTS			((MAX_SECTOR_SIZE + CMD_SIZE - 2) / (CMD_SIZE - 1))	// Data reports of the largest CMD_WRITE
+
+// Writing: a second thread prepares the CMD_WRITEs ahead of the one that sends them
+#define PIPELINE_SLOTS			8		// Prepared commands waiting to be sent, a power of two
+#define PIPELINE_POLL_US		250		// Preparation thread, while all slots are full
+#define PIPELINE_CHECKS			2		// Written blocks on their way back to be compared and hashed
+
+// Completion polling via CMD_GET_STATUS
+#define POLL_INTERVAL_US		1000
+#define ERASE_TIMEOUT_MS		10000
+#define COMMAND_TIMEOUT_MS		1000
+
+// Protocol trace, kept in memory and written out on failure or request
+#define TRACE_RECORDS			4096	// Reports kept, older ones get overwritten
+#define TRACE_OUT				0
+#define TRACE_IN				1
+#define TRACE_MAGIC				"XTRC"
+#define TRACE_VERSION			1
+#define TRACE_FILE				"xbit_flasher.trace"
+
+// Block digest cache
+#define CACHE_MAGIC				"XBCC"
+#define CACHE_VERSION			1
+#define CACHE_SAMPLE			16		// Bytes per block read back to tell if the cache still describes the chip
+#define CACHE_DIR				".xbit_cache"	// In $XBIT_CACHE_DIR, else in the home directory
+
+// Host controller timing profiles, and the (c)alibrate that seeds them
+#define PROFILE_MAGIC			"XBIT-PROFILE"
+#define PROFILE_VERSION			1
+#define PROFILE_EXT				".profile"	// Next to the block cache of the same device
+#define PROFILE_MAX_BAD_RUNS	3		// Failed jobs in a row before a profile is dropped for the defaults
+#define CALIBRATION_ROUNDS		16		// Status + read round trips per path and pacing
+#define CALIBRATION_READ		((CMD_SIZE - 1) * 4)	// Bytes read back per round
+
+// Progress display
+#define PROGRESS_HZ				10		// Redraws per second on a terminal
+#define PROGRESS_LOG_SECONDS	5		// Seconds between progress lines otherwise
+#define PROGRESS_BLOCKS			0		// What a progress phase counts
+#define PROGRESS_OUT			1		// Bytes sent
+#define PROGRESS_IN				2		// Bytes received
+
 #define BANK_LAYOUT_COUNT		6
 #define BANKS_MAX				6
 
-// Sizes are given in kbytes
-int bank_layout[BANK_LAYOUT_COUNT][BANKS_MAX] = {
+// Sizes are given in kbytes. Checked and turned into BANK_SCHEDULEs at compile time, see below
+constexpr int bank_layout[BANK_LAYOUT_COUNT][BANKS_MAX] = {
 	// 0   1     2    3    4    5
 	{512,  512,  256, 256, 256, 256},	// Layout 1
 	{1024, 256,  256, 256, 256, 0},		// Layout 2
@@ -44,7 +147,7 @@ int bank_layout[BANK_LAYOUT_COUNT][BANKS_MAX] = {
 	{2048, 0,    0,   0 ,  0,   0},		// Layout 6	
 };
 
-char bios_select_switches[] = {
+static const char bios_select_switches[] = {
 	0x00,	// Bios 0 - Off Off Off
 	0x01,	// Bios 1 - On  Off Off
 	0x02,	// Bios 2 - Off On  Off
@@ -59,6 +162,101 @@ typedef unsigned char uint8;
 typedef unsigned short uint16; 
 typedef unsigned int uint32; 
 
+/////////// Bank schedules
+// Where each bank of each layout sits and the sector transfers that cover it, in order.
+// The image offset of transfers[i] is i * MAX_SECTOR_SIZE
+typedef struct
+{
+	uchar block;
+	uchar sector;
+	uint16 offset;			// Inside the block
+} TRANSFER;
+
+typedef struct
+{
+	int start_block;
+	int block_count;
+	int size;
+	int transfer_count;
+	TRANSFER transfers[TOTAL_BLOCKS * SECTORS_PER_BLOCK];
+} BANK_SCHEDULE;
+
+typedef struct
+{
+	BANK_SCHEDULE banks[BANK_LAYOUT_COUNT][BANKS_MAX];
+	BANK_SCHEDULE chip;		// All blocks, for whole-chip dumps and programming
+} LAYOUT_TABLE;
+
+constexpr BANK_SCHEDULE MakeSchedule(int start_block, int block_count)
+{
+	BANK_SCHEDULE schedule = {};
+
+	schedule.start_block = start_block;
+	schedule.block_count = block_count;
+	schedule.size = block_count * BLOCK_SIZE;
+	for(int block = start_block; block < start_block + block_count; block++){
+		for(int sector = 0; sector < SECTORS_PER_BLOCK; sector++){
+			TRANSFER &transfer = schedule.transfers[schedule.transfer_count++];
+			transfer.block = block;
+			transfer.sector = sector;
+			transfer.offset = sector * MAX_SECTOR_SIZE;
+		}
+	}
+	return schedule;
+}
+
+constexpr LAYOUT_TABLE MakeLayoutTable()
+{
+	LAYOUT_TABLE table = {};
+
+	for(int layout = 0; layout < BANK_LAYOUT_COUNT; layout++){
+		int block = 0;
+		for(int bank = 0; bank < BANKS_MAX; bank++){
+			int blocks = bank_layout[layout][bank] * 1024 / BLOCK_SIZE;
+			table.banks[layout][bank] = MakeSchedule(block, blocks);
+			block += blocks;
+		}
+	}
+	table.chip = MakeSchedule(0, TOTAL_BLOCKS);
+	return table;
+}
+
+constexpr bool LayoutIsValid(int layout)
+{
+	int total = 0;
+	bool ended = false;
+
+	for(int bank = 0; bank < BANKS_MAX; bank++){
+		int size = bank_layout[layout][bank] * 1024;
+		if(size % BLOCK_SIZE || size < 0 || (ended && size))
+			return false;		// Partial blocks, or a gap between banks
+		ended = ended || !size;
+		total += size;
+	}
+	return total == TOTAL_BLOCKS * BLOCK_SIZE && bank_layout[layout][0];
+}
+
+static_assert(LayoutIsValid(0) && LayoutIsValid(1) && LayoutIsValid(2) && LayoutIsValid(3) && LayoutIsValid(4) && LayoutIsValid(5),
+	"every layout has to fill the flash with whole blocks, banks in a row");
+static_assert(MAX_SECTOR_SIZE * SECTORS_PER_BLOCK == BLOCK_SIZE, "sectors have to split a block evenly");
+static_assert(TOTAL_BLOCKS <= 0x100 && BLOCK_SIZE <= 0x10000, "block index and offset have to fit CMD_READ/CMD_WRITE");
+
+constexpr LAYOUT_TABLE layout_table = MakeLayoutTable();
+
+static_assert(layout_table.banks[0][2].start_block == 16 && layout_table.banks[0][5].block_count == 4, "layout 1 schedule");
+static_assert(layout_table.banks[5][0].transfer_count == TOTAL_BLOCKS * SECTORS_PER_BLOCK, "layout 6 schedule");
+
+// NULL for banks that don't exist in the layout, checked before anything goes to the chip
+inline const BANK_SCHEDULE *GetBankSchedule(int layout, int bank)
+{
+	if(layout < 1 || layout > BANK_LAYOUT_COUNT || bank < 1 || bank > BANKS_MAX || !bank_layout[layout - 1][bank - 1])
+		return NULL;
+	return &layout_table.banks[layout - 1][bank - 1];
+}
+
+
+// IMPORTANT: Reports are sent as-is, define single byte packing
+#pragma pack(push, 1)
 
 typedef struct 
 { 
@@ -106,34 +304,452 @@ typedef struct
    
 } REPORT_BUF, *PREPORT_BUF;
 
+typedef struct
+{
+	unsigned long long time_us;
+	short result;				// What the transport returned, sizeof(REPORT_BUF) if all went well
+	uchar dir;					// TRACE_OUT or TRACE_IN
+	REPORT_BUF report;
+} TRACE_RECORD;
+
+#pragma pack(pop)
+
+typedef struct
+{
+	uchar status;		// SECTOR_xxx
+	uchar writes;
+	uchar erases;		// Block re-erases caused by this sector
+} SECTOR_RESULT;
+
+// Whole-chip image: this header, then TOTAL_BLOCKS * BLOCK_SIZE bytes of flash
+#define CHIP_IMAGE_MAGIC		"XBIT"
+#define CHIP_IMAGE_VERSION		1
+
+#pragma pack(push, 1)
+typedef struct
+{
+	char magic[4];
+	uchar version;
+	uchar layout;			// Page register the chip was dumped with
+	uchar reserved[2];
+	uint32 size;			// Flash bytes following the header, little endian
+} CHIP_HEADER;
+#pragma pack(pop)
+
+// Range of a bank that does not match the image, as found by VerifyBank
+typedef struct
+{
+	uchar block;
+	uchar sector;
+	uint16 offset;			// Inside the sector
+	uint16 length;
+	uint16 differing;		// Bytes that differ, the range may include some matching ones
+} MISMATCH;
+
+// Per-report latency samples, collected while XbitFlasher::io_stats is set
+typedef struct
+{
+	std::vector<uint32> write_us;
+	std::vector<uint32> read_us;
+	unsigned long long write_bytes;
+	unsigned long long read_bytes;
+} IO_STATS;
+
+
+// Adapts the delay between output reports at runtime:
+// narrows it while sectors are confirmed by checksum or readback, backs off on failures
+class ReportPacer
+{
+public:
+	ReportPacer();
+	void Reset();
+	void SetStart(int delay_us);	// Where Reset starts from, e.g. a calibrated delay
+	void Wait();
+	int GetDelay();
+	int GetFailures();
+	int GetConfirmed();
+	unsigned long GetReports();
+	int GetThroughput();			// Payload bytes/s, 0 before anything was sent
+	void ReportSent(int payload_bytes);
+	void ReportFailed();
+	void SectorGood();				// Only once its checksum or a readback matched
+	void SectorFailed();
+	void PrintStats();
+
+private:
+	int start_us;
+	int delay_us;
+	int floor_us;			// Never go below this again, a failure was seen close to it
+	int failures;
+	int confirmed;			// SectorGood calls, what the delay was narrowed on
+	unsigned long reports;
+	unsigned long payload_bytes;
+	unsigned long long first_us;
+	unsigned long long last_us;
+
+	void BackOff();
+};
+
+// How often and how hard to retry a failing operation on a block
+class RetryPolicy
+{
+public:
+	int max_attempts;		// Failures after which we give up
+	int erase_after;		// Failure count that triggers a re-erase
+	int bus_after;			// ... re-acquiring the bus
+	int reopen_after;		// ... reopening the device
+	int base_delay_us;
+	int max_delay_us;
+	int jitter_percent;
+
+	RetryPolicy();
+	int GetAction(int failures);
+	int GetDelay(int failures);
+
+private:
+	std::minstd_rand jitter;	// Own one per chip, rand() is shared between the --all threads
+};
+
+// One status line for the running operation, rate limited so the console never slows down the transfer
+class ProgressMeter
+{
+public:
+	bool enabled;			// Off in quiet mode
+	bool redraw;			// Redraw one line in place, otherwise log a line now and then
+	bool deferred;			// Advance only counts, another thread draws through Poll
+
+	ProgressMeter();
+	void BeginJob(int banks);
+	void EndBank();
+	void Start(const char *label, int bank, unsigned long total, int unit);
+	void Advance(int unit, unsigned long amount);
+	void Poll();						// Draws if due, for the thread that does not send
+	unsigned long GetDone();
+	void SetDone(unsigned long done);	// Rewinds when data has to be sent again
+	void Retry();
+	void Finish();
+
+private:
+	std::atomic<const char *> label;	// A string literal
+	int bank;
+	int unit;
+	unsigned long total;
+	std::atomic<unsigned long> done;
+	std::atomic<int> retries;
+	int banks;
+	int banks_done;
+	std::atomic<bool> active;
+	unsigned long long start_us;
+	unsigned long long next_draw_us;
+
+	void Draw(bool final);
+};
+
+// Last TRACE_RECORDS reports that went over the wire, costs a memcpy per report
+class TraceRing
+{
+public:
+	TraceRing();
+	~TraceRing();
+	void Clear();
+	const TRACE_RECORD *Record(uchar dir, const REPORT_BUF *report, int result, unsigned long long time_us);
+	int GetCount();
+	const TRACE_RECORD *Get(int index);	// 0 is the oldest record
+	bool Save(const char *filename);
+	bool Load(const char *filename);
+
+private:
+	TRACE_RECORD *records;
+	int next;
+	int count;
+};
+
+// Turns records back into MCU_CMD fields, needs to see them in order
+typedef struct
+{
+	unsigned long long first_us;
+	int remaining;				// Data bytes still to come after a CMD_READ/CMD_WRITE
+	bool hex;					// Print all payload bytes, not just the first few
+} TRACE_DECODER;
+
+void TraceDecoderInit(TRACE_DECODER *decoder);
+void TraceDecode(TRACE_DECODER *decoder, const TRACE_RECORD *record, char *line, int size);
+
+// One CMD_WRITE ready to go over the wire
+typedef struct
+{
+	int block;
+	uint16 offset;			// In the block
+	uint16 nBytes;
+	uchar checksum;			// What the chip should report back
+	bool blank;				// Only 0xFF
+	bool send;				// false for a blank range of an erased block, only counted
+	bool last;				// Last command of its block
+	int count;				// Reports, the CMD_WRITE and then its data reports
+	REPORT_BUF reports[STREAM_REPORTS + 1];
+} WRITE_FRAMES;
+
+void BuildWriteFrames(WRITE_FRAMES *frames, int block, uint16 offset, const uchar *buffer, uint16 nBytes);
+
+// Lock-free queue of prepared commands between exactly one producer and one consumer thread
+class FrameRing
+{
+public:
+	FrameRing();
+	~FrameRing();
+	WRITE_FRAMES *Claim();		// Producer: slot to fill, NULL while all are taken
+	void Publish();
+	void Finish();				// Producer: nothing more to come
+	WRITE_FRAMES *Peek();		// Consumer: oldest prepared slot, NULL while there is none
+	void WaitPublished();		// Consumer: sleeps until there is one or nothing more comes
+	void Release();
+	void Stop();				// Consumer: not taking any more
+	bool IsFinished();
+	bool IsStopped();
+
+private:
+	WRITE_FRAMES *slots;
+	std::atomic<unsigned> head;	// Slots published so far, only the producer moves it
+	std::atomic<unsigned> tail;	// Slots released so far, only the consumer moves it
+	std::atomic<bool> finished;
+	std::atomic<bool> stopped;
+	std::mutex mutex;			// Only to sleep on, the slots go without it
+	std::condition_variable published;
+
+	void Wake();
+};
+
+// A block the writer is done with, handed back to the preparation thread.
+// The writer only reads it back from the chip, comparing and hashing it is left to the other side
+typedef struct
+{
+	int block;				// From start_block
+	bool verify;			// readback holds it as read from the chip
+	unsigned long progress_base;	// Progress before its first command went out
+	int good;				// Sectors that matched, in order. Filled in by the preparation thread
+	uchar *readback;		// BLOCK_SIZE
+} BLOCK_CHECK;
+
+// Digests
+#define SHA256_SIZE				32
+
+typedef struct
+{
+	uint32 state[8];
+	unsigned long long length;
+	uchar buffer[64];
+	int used;
+} SHA256_CTX;
+
+void sha256_init(SHA256_CTX *ctx);
+void sha256_update(SHA256_CTX *ctx, const uchar *data, int length);
+void sha256_final(SHA256_CTX *ctx, uchar *digest);
+void sha256(const uchar *data, int length, uchar *digest);
+uint32 crc32_update(uint32 crc, const uchar *data, int length);	// Start with 0, zlib compatible
+
+// Sidecar of a dump or flashed image: CRC32 and SHA-256 of every block and of the whole image.
+// Plain text, one line per block, so two of them can be diffed
+#define DIGEST_FILE_MAGIC		"XBIT-DIGESTS"
+#define DIGEST_FILE_VERSION		1
+#define DIGEST_FILE_EXT			".digests"
+
+typedef struct
+{
+	int layout;
+	int bank;				// 0 for a whole-chip image
+	int size;
+	uint32 block_crc[TOTAL_BLOCKS];
+	uchar block_sha[TOTAL_BLOCKS][SHA256_SIZE];
+	uint32 image_crc;
+	uchar image_sha[SHA256_SIZE];
+
+	// Running state while the data comes in
+	SHA256_CTX block_ctx;
+	SHA256_CTX image_ctx;
+} IMAGE_DIGESTS;
+
+void DigestsInit(IMAGE_DIGESTS *digests, int layout, int bank);
+void DigestsUpdate(IMAGE_DIGESTS *digests, const uchar *data, int length);	// In order, any chunk size
+void DigestsFinal(IMAGE_DIGESTS *digests);
+bool DigestsSave(const IMAGE_DIGESTS *digests, const char *filename);
+bool DigestsLoad(IMAGE_DIGESTS *digests, const char *filename);
+bool IsDigestFile(const char *filename);
+
+// What we last wrote to or read from each block of a chip, kept on disk between runs.
+// A few sample bytes of every known block are read back when the chip is opened,
+// a chip that was swapped or flashed elsewhere in the meantime drops the whole cache.
+typedef struct
+{
+	uchar valid;
+	uchar checked;			// Sample matched the chip this session, not saved
+	uchar digest[SHA256_SIZE];
+	uchar sample[CACHE_SAMPLE];
+} CACHE_BLOCK;
+
+class BlockCache
+{
+public:
+	bool enabled;			// --no-cache turns it off
+	bool strict;			// --strict: keep the cache up to date, but always ask the chip
+
+	BlockCache();
+	bool Load(const char *transport, const char *path, int layout);
+	bool Save();
+	void Clear(int layout);
+	void SetLayout(int layout);
+	void Invalidate(int block);		// Saved right away, a crash must not leave an old digest behind
+	void InvalidateBlocks(int start_block, int block_count, const bool *which);	// Saved once for all of them
+	void Store(int block, const uchar *digest, const uchar *sample);
+	void StoreData(int block, const uchar *data);
+	void StoreBlank(int block);
+	bool IsUsable(int block);
+	bool NeedsCheck(int block);
+	bool Check(int block, const uchar *sample);
+	const uchar *GetDigest(int block);
+	bool IsBlank(int block);
+
+	static int SampleOffset(int block);
+
+private:
+	char filename[MAX_STR];
+	int layout;
+	bool loaded;
+	bool dirty;
+	CACHE_BLOCK blocks[TOTAL_BLOCKS];
+	uchar blank_digest[SHA256_SIZE];
+};
+
+// Per device state file in the cache directory, e.g. ~/.xbit_cache/hid-1-2_1.0.cal
+bool state_path(const char *transport, const char *path, const char *ext, char *filename, int size);
+
+// What last worked for a chip on a host controller, applied when the device is opened
+typedef struct
+{
+	char controller[MAX_STR];	// The chip's host USB controller, e.g. a PCI address on Linux
+	int out_mode;			// Transport XFER_* report paths
+	int in_mode;
+	int pacing_us;			// Where the pacer settled
+	int chunk_size;			// Bytes per CMD_WRITE
+	int round_us;			// Status + read round of the calibrated path, 0 if never calibrated
+	int calibrated_us;		// Fastest pacing calibration found reliable, jobs never save less. 0 if never calibrated
+	int throughput;			// Bytes/s written by the last job that wrote
+	int failure_ppm;		// Failed reports per million in it
+	int runs;
+	int bad_runs;			// Failed jobs in a row
+} PROFILE;
+
+void ProfileDefaults(PROFILE *profile);
+bool ProfileSave(const PROFILE *profile, const char *filename);
+bool ProfileLoad(PROFILE *profile, const char *filename);
+
+// Takes the data of a bank as it is read, sector by sector. false aborts the read
+typedef bool (*SECTOR_SINK)(void *context, int offset, const uchar *data, int length);
+
+class Transport;
+
+// Helpers
+void log_set_prefix(const char *prefix);
+const char *log_get_prefix();
+void log_set_output(FILE *file);
+void log_printf(const char *fmt, ...);
+void log_status(const char *line, bool final);
+unsigned long long get_time_us();
+
+// Byte kernels run on every sector, vectorized where the CPU allows it (kernels.cpp)
+#define BYTE_KERNELS_MAX		4
+
+typedef struct
+{
+	const char *name;
+	uchar (*sum8)(const uchar *data, int length);
+	bool (*is_blank)(const uchar *data, int length);
+	int (*find_diff)(const uchar *a, const uchar *b, int length);
+} BYTE_KERNELS;
+
+int byte_kernels_available(const BYTE_KERNELS **list, int max);
+const BYTE_KERNELS *byte_kernels();
+uchar sum8(const uchar *data, int length);				// Additive checksum, as the chip reports it
+bool is_blank(const uchar *data, int length);			// All 0xFF
+int find_diff(const uchar *a, const uchar *b, int length);	// First differing offset, -1 if equal
+int compare_readback(const uchar *read, const uchar *expected, int length);	// VERIFY_*, no reads
 
 class XbitFlasher
 {
 public:
 	int memory_layout_id;
+	int poll_interval_us;
+	int erase_timeout_ms;
+	int command_timeout_ms;
+	bool diff_mode;			// Only erase/write blocks that differ from the image
+	bool blank_check;		// Read blocks of unknown state before erasing them
+	bool verify_mode;		// Read back and compare every sector right after writing it
+	bool verify_fail_fast;	// (v)erify: stop at the first sector that does not match
+	std::vector<MISMATCH> mismatches;	// Filled by VerifyBank
+	RetryPolicy retry;
+	IO_STATS *io_stats;		// NULL unless someone is measuring
+	TraceRing trace;
+	ProgressMeter progress;
+	BlockCache cache;
+	bool trace_verbose;		// Log every report as it goes over the wire
+	const char *trace_file;	// Save the trace here after the job, NULL saves it on failure only
+	int chunk_size;			// Bytes per CMD_WRITE, halved on write failures, grows back on clean blocks
+	bool use_profile;		// Load and update the timing profile, --no-profile turns it off
+	int queue_depth;		// Data reports in flight at once, 1 paces every single one. Needs Transport::CanQueue
+	bool use_pipeline;		// Prepare the CMD_WRITEs of a bank in a second thread, --no-pipeline turns it off
 	XbitFlasher();
 	~XbitFlasher();
-	bool OpenDevice();
+	bool SetTransport(int type);
+	int EnumerateDevices(char paths[][MAX_STR], int max_devices);
+	bool OpenDevice(const char *path);
 	bool CloseDevice();
-	hid_device *GetHandle();
+	Transport *GetTransport();
 
 	bool Format(int layout);
 	bool EraseBank(int bank);
-	bool FlashBank(int bank, uchar *input_data, int data_length);
-	bool ReadBank(int bank, uchar *output_data, int *num_bytes_read);
-	bool VerifyBank(int bank, uchar *input_data, int data_length);
+	bool FlashBank(int bank, const uchar *input_data, int data_length);
+	bool ReadBank(int bank, SECTOR_SINK sink, void *context, int *num_bytes_read);
+	bool VerifyBank(int bank, const uchar *input_data, int data_length);
+	bool VerifyBankDigests(int bank, const IMAGE_DIGESTS *expected);
+	bool ReadChip(SECTOR_SINK sink, void *context, int *num_bytes_read);
+	bool ProgramChip(int layout, const uchar *input_data);
+	bool BeginSession();
+	bool EndSession();
+	bool Calibrate();
+	void RecordJob(bool ok);
 
 	void PrintMemoryBankLayout();
 	void PrintBankSelection();
 	void PrintUsage(const char* argv0);
 
 private:
-	hid_device *handle;
+	Transport *transport;
+	char device_path[MAX_STR];
 	bool device_initialized;
+	bool checksum_reported;	// The chip fills in the checksum of a CMD_WRITE, seen from a status with it set
+	bool bus_session;
+	bool cache_checked;		// Samples of the cached blocks compared with this chip since it was opened
 	REPORT_BUF statusBuf;
+	ReportPacer pacer;
+	TRACE_DECODER trace_decoder;
+	uchar block_state[TOTAL_BLOCKS];
+	bool block_confirmed[TOTAL_BLOCKS];	// Every CMD_WRITE since the last erase came back with its checksum
+	int stream_depth;		// queue_depth in use, halved on write failures, grows back on clean blocks
+	int skipped_bytes;
+	SECTOR_RESULT sector_results[TOTAL_BLOCKS][SECTORS_PER_BLOCK];
+	uchar retry_stats[TOTAL_BLOCKS][RETRY_PHASE_COUNT];
+	uchar sector_buf[MAX_SECTOR_SIZE];	// Read target, keeps the sector off the stack of the calling thread
+	WRITE_FRAMES write_frames;	// WriteFlash outside of the pipeline
+	PROFILE profile;
+	char profile_file[MAX_STR];	// Empty without a profile
 
 	int InternalRead(PREPORT_BUF output);
 	int InternalWrite(PREPORT_BUF input);
+	bool InternalWriteStream(WRITE_FRAMES *frames);
+	void TraceReport(uchar dir, PREPORT_BUF report, int result, unsigned long long time_us);
+
+	bool Reopen();
+	int Recover(int block, int phase, int failures);
+	void PrintRetryStats();
 
 	bool IsDeviceInitialized();
 	bool IsValidStatus();
@@ -146,18 +762,40 @@ private:
 	bool IsDeviceWriteprotected();
 
 	bool GetStatus();
+	bool WaitForCommand(uchar cmd, int timeout_ms);
+	bool WaitForCompletion(int timeout_ms);
 	bool Reset();
 	bool SetVM(uchar vm);
 	bool GetBus();
 	bool ReleaseBus();
 	bool SetPage(int layout_id);
 	bool ReadFlash(uchar flash, uchar sector, uint16 offset, uchar *buffer, uint16 nBytes);
-	bool WriteFlash(uchar flash, uchar sector, uint16 offset, uchar *buffer, uint16 nBytes);
+	bool WriteFlash(uchar flash, uchar sector, uint16 offset, const uchar *buffer, uint16 nBytes);
+	bool SendFrames(WRITE_FRAMES *frames);
 	bool EraseBlock(int flash, int sector);
+	bool EraseBlocks(int start_block, int block_count, const bool *needed);
+	void CheckCache();
+	const uchar *CachedDigest(int block);
+	bool IsBlockErased(int block);
+	bool WriteSector(int block, uint16 offset, const uchar *data, int length, bool erased);
+	int VerifySector(int block, uint16 offset, const uchar *expected, int length);
+	bool WriteBlock(int block, const uchar *data, bool erased);
+	bool FinishBlock(BLOCK_CHECK *check);
+	bool CheckedBlock(const BLOCK_CHECK *check);
+	int WritePipelined(int start_block, int block_count, const uchar *input_data, const bool *changed);
+	void PrintSectorResults(int start_block, int block_count);
+	void PrintMismatches();
+	bool DiffBlocks(int start_block, int block_count, const uchar *input_data, bool *changed);
+	bool WriteBlocks(const BANK_SCHEDULE *schedule, const uchar *input_data, int bank);
+	bool ReadBlocks(const BANK_SCHEDULE *schedule, SECTOR_SINK sink, void *context, int *num_bytes_read);
+
+	const BANK_SCHEDULE *GetSchedule(int bank);
 
-	uchar CalculateBlockIndexForOffset(int offset);
-	int GetStartblockForBank(int layout, int bank);
-	int GetSizeForBank(int layout, int bank);
+	bool GetProfilePath(char *filename, int size);
+	bool ApplyProfile();
+	void LoadProfile();
+	bool CalibrationRound(int round, const uchar *reference, int *rtt_us);
+	void Settle();
 };
 
 #endif
\ No newline at end of file